@@ -2,29 +2,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "image.h"
 #include "list.h"
 
-data random_batch(data d, int n)
+// Copy n random rows of d into a new batch, widening the inputs to double.
+minibatch random_batch(data d, int n)
 {
-    matrix X = {0};
-    matrix y = {0};
-    X.shallow = y.shallow = 1;
-    X.rows = y.rows = n;
-    X.cols = d.X.cols;
-    y.cols = d.y.cols;
-    X.data = calloc(n, sizeof(double*));
-    y.data = calloc(n, sizeof(double*));
-    int i;
+    minibatch b;
+    b.X = make_matrix(n, d.X.cols);
+    b.y = make_matrix(n, d.y.cols);
+    int i, j;
     for(i = 0; i < n; ++i){
         int ind = rand()%d.X.rows;
-        X.data[i] = d.X.data[ind];
-        y.data[i] = d.y.data[ind];
+        const float *x = d.X.vals + (size_t)ind*d.X.cols;
+        for(j = 0; j < d.X.cols; ++j) b.X.data[i][j] = x[j];
+        memcpy(b.y.data[i], d.y.data[ind], d.y.cols*sizeof(double));
     }
-    data c;
-    c.X = X;
-    c.y = y;
-    return c;
+    return b;
 }
 
 list *get_lines(char *filename)
@@ -43,47 +43,275 @@ list *get_lines(char *filename)
     return lines;
 }
 
-data load_classification_data(char *images, char *label_file, int bias)
+typedef struct{
+    char **paths;
+    int n, cols;
+    float_matrix X;
+    int *ok;
+    int next;
+} batch_job;
+
+static void *batch_worker(void *arg)
 {
-    list *image_list = get_lines(images);
-    list *label_list = get_lines(label_file);
-    int k = label_list->size;
-    char **labels = (char **)list_to_array(label_list);
+    batch_job *job = arg;
+    int i;
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n){
+        job->ok[i] = load_image_row(job->paths[i], job->X.vals + (size_t)i*job->X.cols, job->cols);
+    }
+    return 0;
+}
 
-    int n = image_list->size;
-    node *nd = image_list->front;
-    int cols = 0;
+// Decode images on a pool of worker threads, each straight into its row of X.
+// char **paths: n image files
+// float_matrix X: destination, row i gets image i in its first cols values
+// int *ok: set to 1 for each image that loaded, 0 for ones that didn't
+// int threads: worker count, less than 1 for one per CPU
+// returns: number of images that failed to load
+int load_image_batch(char **paths, int n, float_matrix X, int cols, int *ok, int threads)
+{
+    batch_job job = {paths, n, cols, X, ok, 0};
+    if(threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > n) threads = n;
+    if(threads < 1) threads = 1;
+    pthread_t *pool = calloc(threads, sizeof(pthread_t));
+    int i, started = 0, fails = 0;
+    for(i = 1; i < threads; ++i){
+        if(!pthread_create(pool + started, 0, batch_worker, &job)) ++started;
+    }
+    batch_worker(&job);
+    for(i = 0; i < started; ++i) pthread_join(pool[i], 0);
+    free(pool);
+    for(i = 0; i < n; ++i) fails += !ok[i];
+    return fails;
+}
+
+// Decoded datasets are cached next to the image list (images.cache), or in
+// the directory set with set_data_cache_dir or UWIMG_CACHE_DIR, and are
+// mapped back in on later loads instead of decoding every file again. The
+// cache is keyed on the list and label files' contents and the mtime and size
+// of every image, so editing any of them rebuilds it. Pixels are stored as
+// bytes, which is lossless since they're all 8-bit samples over 255, and
+// labels as one byte per class since a path can match more than one.
+
+#define CACHE_MAGIC "UWDS"
+#define CACHE_VERSION 1
+
+typedef struct{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t n, cols, k, pad;
+} cache_header;
+
+static int data_cache = 1;
+
+// Turn the dataset cache used by load_classification_data on or off.
+void set_data_cache(int on)
+{
+    data_cache = on;
+}
+
+static char cache_dir[4096];
+
+// Put dataset caches in dir instead of next to each image list. The
+// directory must already exist. NULL or "" goes back to UWIMG_CACHE_DIR if
+// that is set, otherwise to caching next to the list.
+void set_data_cache_dir(const char *dir)
+{
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir ? dir : "");
+}
+
+// Path of the cache for an image list. In a cache directory the list's path
+// is flattened into the name, so lists with the same name don't collide.
+static void cache_path(const char *images, char *path, size_t size)
+{
+    const char *dir = cache_dir[0] ? cache_dir : getenv("UWIMG_CACHE_DIR");
+    if(!dir || !dir[0]){
+        snprintf(path, size, "%s.cache", images);
+        return;
+    }
+    int n = snprintf(path, size, "%s/", dir);
+    if(n < 0 || (size_t)n >= size) n = size - 1;
+    snprintf(path + n, size - n, "%s.cache", images);
+    char *c;
+    for(c = path + n; *c; ++c) if(*c == '/') *c = '_';
+}
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t n)
+{
+    const unsigned char *b = p;
+    size_t i;
+    for(i = 0; i < n; ++i){
+        h ^= b[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t hash_file(uint64_t h, const char *filename)
+{
+    unsigned char buff[1 << 16];
+    size_t n;
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return h;
+    while((n = fread(buff, 1, sizeof(buff), fp))) h = fnv1a(h, buff, n);
+    fclose(fp);
+    return h;
+}
+
+static uint64_t dataset_key(char *images, char *label_file, char **paths, int n)
+{
+    uint64_t h = 14695981039346656037ull;
+    h = hash_file(h, images);
+    h = hash_file(h, label_file);
     int i;
-    int count = 0;
-    matrix X;
-    matrix y = make_matrix(n, k);
-    while(nd){
-        char *path = (char *)nd->val;
-        image im = load_image(path);
-        if (!cols) {
-            cols = im.w*im.h*im.c;
-            X = make_matrix(n, cols + (bias != 0));
-        }
-        for (i = 0; i < cols; ++i){
-            X.data[count][i] = im.data[i];
+    for(i = 0; i < n; ++i){
+        struct stat st;
+        int64_t stamp[3] = {0, 0, 0};
+        if(!stat(paths[i], &st)){
+            stamp[0] = st.st_mtim.tv_sec;
+            stamp[1] = st.st_mtim.tv_nsec;
+            stamp[2] = st.st_size;
         }
-        if(bias) X.data[count][cols] = 1;
+        h = fnv1a(h, stamp, sizeof(stamp));
+    }
+    return h;
+}
+
+static int load_dataset_cache(const char *filename, uint64_t key, int bias, data *d)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat st;
+    cache_header hd;
+    if(fstat(fd, &st) || pread(fd, &hd, sizeof(hd), 0) != sizeof(hd) ||
+            memcmp(hd.magic, CACHE_MAGIC, 4) || hd.version != CACHE_VERSION || hd.key != key ||
+            hd.n < 0 || hd.cols < 0 || hd.k < 0 ||
+            (uint64_t)st.st_size != sizeof(hd) + (uint64_t)hd.n*(hd.cols + hd.k)){
+        close(fd);
+        return 0;
+    }
+    unsigned char *base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return 0;
+
+    const unsigned char *x = base + sizeof(hd);
+    const unsigned char *y = x + (size_t)hd.n*hd.cols;
+    d->X = make_float_matrix(hd.n, hd.cols + (bias != 0));
+    d->y = make_matrix(hd.n, hd.k);
+    int i, j;
+    for(i = 0; i < hd.n; ++i){
+        float *row = d->X.vals + (size_t)i*d->X.cols;
+        const unsigned char *src = x + (size_t)i*hd.cols;
+        for(j = 0; j < hd.cols; ++j) row[j] = (float)src[j]*(1.f/255);
+        if(bias) row[hd.cols] = 1;
+        for(j = 0; j < hd.k; ++j) d->y.data[i][j] = y[(size_t)i*hd.k + j];
+    }
+    munmap(base, st.st_size);
+    return 1;
+}
+
+// Written to a temporary file and renamed into place, so a reader never sees
+// a partial cache. Failing to write it isn't an error.
+static void save_dataset_cache(const char *filename, uint64_t key, data d, int cols)
+{
+    char tmp[4096 + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", filename, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if(!fp) return;
+    cache_header hd = {{0}};
+    memcpy(hd.magic, CACHE_MAGIC, 4);
+    hd.version = CACHE_VERSION;
+    hd.key = key;
+    hd.n = d.X.rows;
+    hd.cols = cols;
+    hd.k = d.y.cols;
+    int ok = fwrite(&hd, sizeof(hd), 1, fp) == 1;
+    unsigned char *buff = malloc(cols > hd.k ? cols : hd.k);
+    int i, j;
+    for(i = 0; ok && i < d.X.rows; ++i){
+        const float *x = d.X.vals + (size_t)i*d.X.cols;
+        for(j = 0; j < cols; ++j) buff[j] = (unsigned char)(x[j]*255 + .5f);
+        ok = fwrite(buff, 1, cols, fp) == (size_t)cols;
+    }
+    for(i = 0; ok && i < d.y.rows; ++i){
+        for(j = 0; j < hd.k; ++j) buff[j] = d.y.data[i][j] != 0;
+        ok = fwrite(buff, 1, hd.k, fp) == (size_t)hd.k;
+    }
+    free(buff);
+    if(fclose(fp) || !ok || rename(tmp, filename)) remove(tmp);
+}
+
+// Decode every image in the list and match its path against the labels.
+// int *cols: set to the number of pixels per image
+static data decode_classification_data(char **paths, int n, char **labels, int k, int bias, int *cols)
+{
+    int i, j;
+    *cols = 0;
+    for(i = 0; i < n && !*cols; ++i) *cols = image_file_size(paths[i]);
+    float_matrix X = make_float_matrix(n, *cols + (bias != 0));
+    matrix y = make_matrix(n, k);
+    int *ok = calloc((unsigned)n, sizeof(int));
+    load_image_batch(paths, n, X, *cols, ok, 0);
 
-        for (i = 0; i < k; ++i){
-            if(strstr(path, labels[i])){
-                y.data[count][i] = 1;
+    // Images that didn't load are reported and left out.
+    int count = 0;
+    for(i = 0; i < n; ++i){
+        if(!ok[i]){
+            fprintf(stderr, "Couldn't load image \"%s\", skipping\n", paths[i]);
+            continue;
+        }
+        float *row = X.vals + (size_t)count*X.cols;
+        if(count != i) memcpy(row, X.vals + (size_t)i*X.cols, *cols*sizeof(float));
+        if(bias) row[*cols] = 1;
+        for (j = 0; j < k; ++j){
+            if(strstr(paths[i], labels[j])){
+                y.data[count][j] = 1;
             }
         }
         ++count;
-        nd = nd->next;
     }
-    free_list(image_list);
+    X.rows = y.rows = count;
+    free(ok);
     data d;
     d.X = X;
     d.y = y;
     return d;
 }
 
+data load_classification_data(char *images, char *label_file, int bias)
+{
+    list *image_list = get_lines(images);
+    list *label_list = get_lines(label_file);
+    int k = label_list->size;
+    char **labels = (char **)list_to_array(label_list);
+    int n = image_list->size;
+    char **paths = (char **)list_to_array(image_list);
+
+    data d;
+    if(data_cache){
+        char cache[4096];
+        cache_path(images, cache, sizeof(cache));
+        uint64_t key = dataset_key(images, label_file, paths, n);
+        if(!load_dataset_cache(cache, key, bias, &d)){
+            int cols;
+            d = decode_classification_data(paths, n, labels, k, bias, &cols);
+            save_dataset_cache(cache, key, d, cols);
+        }
+    } else {
+        int cols;
+        d = decode_classification_data(paths, n, labels, k, bias, &cols);
+    }
+
+    free(paths);
+    free(labels);
+    free_list_contents(image_list);
+    free_list_contents(label_list);
+    free_list(image_list);
+    free_list(label_list);
+    return d;
+}
+
 
 char *fgetl(FILE *fp)
 {
@@ -119,7 +347,7 @@ char *fgetl(FILE *fp)
 
 void free_data(data d)
 {
-    free_matrix(d.X);
+    free_float_matrix(d.X);
     free_matrix(d.y);
 }
 
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Frame sequences on disk, for running video processing without a camera or
+// a display. A sequence is either a directory of images, read in name order,
+// or a single .bin file holding frames back to back in the format written by
+// save_image_binary (so a file from save_image_binary is a one frame stream,
+// and streams in the legacy headerless format still read).
+
+struct frame_reader{
+    FILE *fp;       // Open .bin stream, or 0 for a directory
+    char **files;   // Image paths in a directory, sorted
+    int n, next;
+};
+
+struct frame_writer{
+    FILE *fp;       // Open .bin stream, or 0 for a directory
+    char *dir;
+    int n;
+};
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && 0 == strcasecmp(s + n - m, suffix);
+}
+
+static int is_image_file(const char *name)
+{
+    return has_suffix(name, ".png") || has_suffix(name, ".jpg") ||
+        has_suffix(name, ".jpeg") || has_suffix(name, ".bmp") ||
+        has_suffix(name, ".tga");
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Open a frame sequence for reading.
+// const char *path: directory of images or .bin frame stream
+// returns: reader, or 0 if path can't be read
+frame_reader *open_frame_reader(const char *path)
+{
+    frame_reader *r = calloc(1, sizeof(frame_reader));
+    struct stat st;
+    if (0 == stat(path, &st) && S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (d) {
+            int cap = 0;
+            struct dirent *e;
+            while ((e = readdir(d))) {
+                if (!is_image_file(e->d_name)) continue;
+                if (r->n == cap) {
+                    cap = cap ? 2*cap : 64;
+                    r->files = realloc(r->files, cap*sizeof(char *));
+                }
+                size_t len = strlen(path) + strlen(e->d_name) + 2;
+                r->files[r->n] = malloc(len);
+                snprintf(r->files[r->n], len, "%s/%s", path, e->d_name);
+                r->n++;
+            }
+            closedir(d);
+            qsort(r->files, r->n, sizeof(char *), compare_names);
+            return r;
+        }
+    } else {
+        r->fp = fopen(path, "rb");
+        if (r->fp) return r;
+    }
+    fprintf(stderr, "Couldn't open frames \"%s\"\n", path);
+    free(r);
+    return 0;
+}
+
+// Read the next frame, reusing the frame's buffer when the size matches.
+// Images in a directory that can't be decoded are reported and skipped.
+// Matches frame_source, so a reader can feed run_flow_stream directly.
+// returns: 1 if a frame was read, 0 at the end of the sequence
+int read_frame(void *reader, image *frame)
+{
+    frame_reader *r = reader;
+    if (!r->fp) {
+        while (r->next < r->n) {
+            const char *file = r->files[r->next++];
+            if (load_image_into(file, frame)) return 1;
+            fprintf(stderr, "Couldn't decode frame \"%s\", skipping\n", file);
+        }
+        return 0;
+    }
+    if (!read_image_binary(r->fp, frame)) return 0;
+    r->next++;
+    return 1;
+}
+
+void close_frame_reader(frame_reader *r)
+{
+    int i;
+    if (!r) return;
+    if (r->fp) fclose(r->fp);
+    for (i = 0; i < r->n; ++i) free(r->files[i]);
+    free(r->files);
+    free(r);
+}
+
+// Open a frame sequence for writing. A path ending in .bin is written as one
+// frame stream, anything else is a directory (created if needed) that gets
+// one numbered PNG per frame.
+// returns: writer, or 0 if path can't be written
+frame_writer *open_frame_writer(const char *path)
+{
+    frame_writer *w = calloc(1, sizeof(frame_writer));
+    if (has_suffix(path, ".bin")) {
+        w->fp = fopen(path, "wb");
+        if (w->fp) return w;
+    } else {
+        struct stat st;
+        mkdir(path, 0755);
+        if (0 == stat(path, &st) && S_ISDIR(st.st_mode)) {
+            w->dir = strdup(path);
+            return w;
+        }
+    }
+    fprintf(stderr, "Couldn't write frames to \"%s\"\n", path);
+    free(w);
+    return 0;
+}
+
+void write_frame(frame_writer *w, image im)
+{
+    if (w->fp) {
+        if (!write_image_binary(im, w->fp)) fprintf(stderr, "Failed to write frame\n");
+    } else {
+        char buff[256];
+        snprintf(buff, sizeof(buff), "%s/%06d", w->dir, w->n);
+        save_png(im, buff);
+    }
+    w->n++;
+}
+
+void close_frame_writer(frame_writer *w)
+{
+    if (!w) return;
+    if (w->fp) fclose(w->fp);
+    free(w->dir);
+    free(w);
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "image.h"
+#include "matrix.h"
+
+// General matrix multiply, C += op(A)*op(B), in the usual blocked form:
+// op(B) is packed KC x NC at a time into NR wide column panels, op(A) is
+// packed MC x KC at a time into MR tall row panels, and a register-blocked
+// micro-kernel multiplies one MR panel by one NR panel straight out of the
+// packed buffers. Packing is where transposes happen, so op(A) = A^T costs
+// the same as op(A) = A.
+//
+// In PRECISION_FLOAT the panels are packed as floats and multiplied with
+// float accumulators, twice as many per register, and each tile is added
+// back into the double C. The matrices themselves stay double.
+//
+// Threads split the micro-tiles of each block between them. Every element
+// of C is written by one thread and accumulated in the same order whatever
+// the thread count, so results don't depend on it.
+
+#define MR 6
+#define NR 8            // Panel width for doubles, twice that for floats
+#define MC 96
+#define KC 256
+#define NC 1024
+#define SMALL 256       // Products with M*N*K below this skip packing
+
+static inline void put(void *buf, size_t i, double v, int single)
+{
+    if(single) ((float *)buf)[i] = v;
+    else ((double *)buf)[i] = v;
+}
+
+// Pack rows [i0, i0+mc) by columns [k0, k0+kc) of op(A) into MR tall
+// panels, k-major within a panel, padding the last panel with zeros.
+static void pack_a(int ta, const double *A, int lda, int i0, int k0, int mc, int kc, void *buf, int single)
+{
+    int p;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(p = 0; p < (mc + MR - 1)/MR; ++p){
+        size_t dst = (size_t)p*MR*kc;
+        int i, k, rows = mc - p*MR < MR ? mc - p*MR : MR;
+        for(k = 0; k < kc; ++k){
+            for(i = 0; i < rows; ++i){
+                int r = i0 + p*MR + i, c = k0 + k;
+                put(buf, dst + k*MR + i, ta ? A[(size_t)c*lda + r] : A[(size_t)r*lda + c], single);
+            }
+            for(; i < MR; ++i) put(buf, dst + k*MR + i, 0, single);
+        }
+    }
+}
+
+// Pack rows [k0, k0+kc) by columns [j0, j0+nc) of op(B) into nr wide
+// panels, k-major within a panel, padding the last panel with zeros.
+static void pack_b(int tb, const double *B, int ldb, int k0, int j0, int kc, int nc, int nr, void *buf, int single)
+{
+    int p;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(p = 0; p < (nc + nr - 1)/nr; ++p){
+        size_t dst = (size_t)p*nr*kc;
+        int j, k, cols = nc - p*nr < nr ? nc - p*nr : nr;
+        for(k = 0; k < kc; ++k){
+            int r = k0 + k;
+            if(!tb && !single && cols == nr){
+                memcpy((double *)buf + dst + k*nr, B + (size_t)r*ldb + j0 + p*nr, nr*sizeof(double));
+                continue;
+            }
+            for(j = 0; j < cols; ++j){
+                int c = j0 + p*nr + j;
+                put(buf, dst + k*nr + j, tb ? B[(size_t)c*ldb + r] : B[(size_t)r*ldb + c], single);
+            }
+            for(; j < nr; ++j) put(buf, dst + k*nr + j, 0, single);
+        }
+    }
+}
+
+// MR x NR tile of a*b over kc, added into the tile of C at c.
+static void kernel_generic(int kc, const void *pa, const void *pb, double *c, int ldc, int mr, int nr)
+{
+    const double *a = pa, *b = pb;
+    double acc[MR][NR] = {{0}};
+    int i, j, k;
+    for(k = 0; k < kc; ++k){
+        for(i = 0; i < MR; ++i){
+            for(j = 0; j < NR; ++j){
+                acc[i][j] += a[k*MR + i]*b[k*NR + j];
+            }
+        }
+    }
+    for(i = 0; i < mr; ++i){
+        for(j = 0; j < nr; ++j){
+            c[(size_t)i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+// MR x 2*NR tile of float panels.
+static void kernel_generic_float(int kc, const void *pa, const void *pb, double *c, int ldc, int mr, int nr)
+{
+    const float *a = pa, *b = pb;
+    float acc[MR][2*NR] = {{0}};
+    int i, j, k;
+    for(k = 0; k < kc; ++k){
+        for(i = 0; i < MR; ++i){
+            for(j = 0; j < 2*NR; ++j){
+                acc[i][j] += a[k*MR + i]*b[k*2*NR + j];
+            }
+        }
+    }
+    for(i = 0; i < mr; ++i){
+        for(j = 0; j < nr; ++j){
+            c[(size_t)i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// The 6x8 tile lives in twelve ymm accumulators, leaving room for the two
+// halves of a row of b and a broadcast element of a. AVX2 and FMA aren't
+// in the x86-64 baseline, so this is compiled for them separately and only
+// used when the CPU has both.
+#define GEMM_SIMD
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int kc, const void *pa, const void *pb, double *c, int ldc, int mr, int nr)
+{
+    const double *a = pa, *b = pb;
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    int k;
+    for(k = 0; k < kc; ++k){
+        __m256d b0 = _mm256_loadu_pd(b);
+        __m256d b1 = _mm256_loadu_pd(b + 4);
+        __m256d x;
+        x = _mm256_broadcast_sd(a + 0); c00 = _mm256_fmadd_pd(x, b0, c00); c01 = _mm256_fmadd_pd(x, b1, c01);
+        x = _mm256_broadcast_sd(a + 1); c10 = _mm256_fmadd_pd(x, b0, c10); c11 = _mm256_fmadd_pd(x, b1, c11);
+        x = _mm256_broadcast_sd(a + 2); c20 = _mm256_fmadd_pd(x, b0, c20); c21 = _mm256_fmadd_pd(x, b1, c21);
+        x = _mm256_broadcast_sd(a + 3); c30 = _mm256_fmadd_pd(x, b0, c30); c31 = _mm256_fmadd_pd(x, b1, c31);
+        x = _mm256_broadcast_sd(a + 4); c40 = _mm256_fmadd_pd(x, b0, c40); c41 = _mm256_fmadd_pd(x, b1, c41);
+        x = _mm256_broadcast_sd(a + 5); c50 = _mm256_fmadd_pd(x, b0, c50); c51 = _mm256_fmadd_pd(x, b1, c51);
+        a += MR;
+        b += NR;
+    }
+    double acc[MR][NR];
+    _mm256_storeu_pd(acc[0], c00); _mm256_storeu_pd(acc[0] + 4, c01);
+    _mm256_storeu_pd(acc[1], c10); _mm256_storeu_pd(acc[1] + 4, c11);
+    _mm256_storeu_pd(acc[2], c20); _mm256_storeu_pd(acc[2] + 4, c21);
+    _mm256_storeu_pd(acc[3], c30); _mm256_storeu_pd(acc[3] + 4, c31);
+    _mm256_storeu_pd(acc[4], c40); _mm256_storeu_pd(acc[4] + 4, c41);
+    _mm256_storeu_pd(acc[5], c50); _mm256_storeu_pd(acc[5] + 4, c51);
+    int i, j;
+    for(i = 0; i < mr; ++i){
+        for(j = 0; j < nr; ++j){
+            c[(size_t)i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+// Same register layout with eight floats per register, so a 6x16 tile.
+__attribute__((target("avx2,fma")))
+static void kernel_avx2_float(int kc, const void *pa, const void *pb, double *c, int ldc, int mr, int nr)
+{
+    const float *a = pa, *b = pb;
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    int k;
+    for(k = 0; k < kc; ++k){
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        __m256 x;
+        x = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(x, b0, c00); c01 = _mm256_fmadd_ps(x, b1, c01);
+        x = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(x, b0, c10); c11 = _mm256_fmadd_ps(x, b1, c11);
+        x = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(x, b0, c20); c21 = _mm256_fmadd_ps(x, b1, c21);
+        x = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(x, b0, c30); c31 = _mm256_fmadd_ps(x, b1, c31);
+        x = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(x, b0, c40); c41 = _mm256_fmadd_ps(x, b1, c41);
+        x = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(x, b0, c50); c51 = _mm256_fmadd_ps(x, b1, c51);
+        a += MR;
+        b += 2*NR;
+    }
+    float acc[MR][2*NR];
+    _mm256_storeu_ps(acc[0], c00); _mm256_storeu_ps(acc[0] + 8, c01);
+    _mm256_storeu_ps(acc[1], c10); _mm256_storeu_ps(acc[1] + 8, c11);
+    _mm256_storeu_ps(acc[2], c20); _mm256_storeu_ps(acc[2] + 8, c21);
+    _mm256_storeu_ps(acc[3], c30); _mm256_storeu_ps(acc[3] + 8, c31);
+    _mm256_storeu_ps(acc[4], c40); _mm256_storeu_ps(acc[4] + 8, c41);
+    _mm256_storeu_ps(acc[5], c50); _mm256_storeu_ps(acc[5] + 8, c51);
+    int i, j;
+    for(i = 0; i < mr; ++i){
+        for(j = 0; j < nr; ++j){
+            c[(size_t)i*ldc + j] += acc[i][j];
+        }
+    }
+}
+#endif
+
+typedef void (*gemm_kernel)(int, const void *, const void *, double *, int, int, int);
+
+static gemm_kernel pick_kernel(int single)
+{
+#ifdef GEMM_SIMD
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return single ? kernel_avx2_float : kernel_avx2;
+    }
+#endif
+    return single ? kernel_generic_float : kernel_generic;
+}
+
+// C += op(A)*op(B) as a plain loop, for products too small for packing
+// and threads to pay for themselves (like the 3x3 by 3x1 products of
+// project_point).
+static void gemm_small(int ta, int tb, int M, int N, int K,
+        const double *A, int lda, const double *B, int ldb, double *C, int ldc)
+{
+    int i, j, k;
+    for(i = 0; i < M; ++i){
+        double *c = C + (size_t)i*ldc;
+        for(k = 0; k < K; ++k){
+            double a = ta ? A[(size_t)k*lda + i] : A[(size_t)i*lda + k];
+            if(tb) for(j = 0; j < N; ++j) c[j] += a*B[(size_t)j*ldb + k];
+            else for(j = 0; j < N; ++j) c[j] += a*B[(size_t)k*ldb + j];
+        }
+    }
+}
+
+// C += op(A)*op(B), where op(A) is M x K and op(B) is K x N, all row-major.
+// int ta, tb: whether to use A^T and B^T instead of A and B
+// int lda, ldb, ldc: elements from one row of each matrix to the next
+// PRECISION p: precision to multiply and accumulate in
+void gemm(int ta, int tb, int M, int N, int K,
+        const double *A, int lda, const double *B, int ldb, double *C, int ldc, PRECISION p)
+{
+    if(M <= 0 || N <= 0 || K <= 0) return;
+    int single = p == PRECISION_FLOAT;
+    if(!single && (size_t)M*N*K < SMALL){
+        gemm_small(ta, tb, M, N, K, A, lda, B, ldb, C, ldc);
+        return;
+    }
+    gemm_kernel kernel = pick_kernel(single);
+    size_t size = single ? sizeof(float) : sizeof(double);
+    int nrp = single ? 2*NR : NR;
+    int kcmax = K < KC ? K : KC;
+    int ncmax = N < NC ? N : NC;
+    int mcmax = M < MC ? M : MC;
+    char *pa = malloc(size*((mcmax + MR - 1)/MR*MR)*kcmax);
+    char *pb = malloc(size*((ncmax + nrp - 1)/nrp*nrp)*kcmax);
+    int jc, pc, ic;
+    for(jc = 0; jc < N; jc += NC){
+        int nc = N - jc < NC ? N - jc : NC;
+        int np = (nc + nrp - 1)/nrp;
+        for(pc = 0; pc < K; pc += KC){
+            int kc = K - pc < KC ? K - pc : KC;
+            pack_b(tb, B, ldb, pc, jc, kc, nc, nrp, pb, single);
+            for(ic = 0; ic < M; ic += MC){
+                int mc = M - ic < MC ? M - ic : MC;
+                int mp = (mc + MR - 1)/MR;
+                pack_a(ta, A, lda, ic, pc, mc, kc, pa, single);
+                int t;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+                for(t = 0; t < mp*np; ++t){
+                    int ip = t / np, jp = t % np;
+                    int mr = mc - ip*MR < MR ? mc - ip*MR : MR;
+                    int nr = nc - jp*nrp < nrp ? nc - jp*nrp : nrp;
+                    double *c = C + (size_t)(ic + ip*MR)*ldc + jc + jp*nrp;
+                    kernel(kc, pa + size*ip*MR*kc, pb + size*jp*nrp*kc, c, ldc, mr, nr);
+                }
+            }
+        }
+    }
+    free(pa);
+    free(pb);
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Time a*b, a^T*b, a*b^T and a*b in float for an m x k by k x n product
+// against the plain triple loop, printing GFLOP/s for each.
+void bench_gemm(int m, int k, int n, int iters)
+{
+    matrix a = random_matrix(m, k, 1);
+    matrix b = random_matrix(k, n, 1);
+    matrix at = transpose_matrix(a);
+    matrix bt = transpose_matrix(b);
+    matrix c = make_matrix(m, n);
+    int it, i, j, l;
+    if(iters < 1) iters = 1;
+    double flops = 2.*m*n*k*iters;
+
+    double start = now_sec();
+    for(it = 0; it < iters; ++it){
+        for(i = 0; i < m; ++i){
+            for(j = 0; j < n; ++j){
+                double sum = 0;
+                for(l = 0; l < k; ++l) sum += a.data[i][l]*b.data[l][j];
+                c.data[i][j] = sum;
+            }
+        }
+    }
+    double naive = now_sec() - start;
+
+    const char *names[] = {"a*b", "a^T*b", "a*b^T", "float"};
+    double times[4];
+    for(l = 0; l < 4; ++l){
+        start = now_sec();
+        for(it = 0; it < iters; ++it){
+            memset(c.vals, 0, sizeof(double)*m*n);
+            if(l == 0) gemm(0, 0, m, n, k, a.vals, a.stride, b.vals, b.stride, c.vals, c.stride, PRECISION_DOUBLE);
+            if(l == 1) gemm(1, 0, m, n, k, at.vals, at.stride, b.vals, b.stride, c.vals, c.stride, PRECISION_DOUBLE);
+            if(l == 2) gemm(0, 1, m, n, k, a.vals, a.stride, bt.vals, bt.stride, c.vals, c.stride, PRECISION_DOUBLE);
+            if(l == 3) gemm(0, 0, m, n, k, a.vals, a.stride, b.vals, b.stride, c.vals, c.stride, PRECISION_FLOAT);
+        }
+        times[l] = now_sec() - start;
+    }
+
+    printf("%dx%d * %dx%d, %d iterations, %d threads\n", m, k, k, n, iters, get_num_threads());
+    printf("naive: %8.3f ms %7.2f GFLOP/s\n", 1000*naive/iters, flops/naive*1e-9);
+    for(l = 0; l < 4; ++l){
+        printf("%-6s %8.3f ms %7.2f GFLOP/s\n", names[l], 1000*times[l]/iters, flops/times[l]*1e-9);
+    }
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(at);
+    free_matrix(bt);
+    free_matrix(c);
+}
@@ -38,41 +38,45 @@ image copy_image(image im) {
     return copy;
 }
 
+// The color conversions and channel arithmetic in this file walk each channel
+// plane of im.data linearly instead of going through get_pixel/set_pixel.
+// Every index is in bounds by construction (shift_image and scale_image
+// ignore an out-of-range channel, as set_pixel did), so no clamping is
+// needed and the compiler is free to vectorize the plane loops.
+
 image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
-    float r, g, b;
+    int n = im.w * im.h;
     image gray = make_image(im.w, im.h, 1);
-    for (int i = 0; i < im.w; i++) {
-      for (int j = 0; j < im.h; j++) {
-        r = get_pixel(im, i, j, 0);
-        g = get_pixel(im, i, j, 1);
-        b = get_pixel(im, i, j, 2);
-        set_pixel(gray, i, j, 0, 0.299 * r + 0.587 * g + 0.114 * b);
-      }
+    const float *r = im.data;
+    const float *g = im.data + n;
+    const float *b = im.data + 2 * n;
+    float *y = gray.data;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int i = 0; i < n; i++) {
+      y[i] = 0.299f * r[i] + 0.587f * g[i] + 0.114f * b[i];
     }
     return gray;
 }
 
 void shift_image(image im, int c, float v) {
-  for (int i = 0; i < im.w; i++) {
-    for (int j = 0; j < im.h; j++) {
-      float originalVal = get_pixel(im, i, j, c);
-      set_pixel(im, i, j, c, originalVal + v);
-    }
+  if (c < 0 || c >= im.c) return;
+  int n = im.w * im.h;
+  float *p = im.data + c * n;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    p[i] += v;
   }
 }
 
 void clamp_image(image im) {
-  float originalVal, clampedVal;
-  for (int i = 0; i < im.w; i++) {
-    for (int j = 0; j < im.h; j++) {
-      for (int k = 0; k < im.c; k++) {
-        originalVal = get_pixel(im, i, j, k);
-        clampedVal = originalVal > 1 ? 1 : (originalVal < 0 ? 0 : originalVal);
-        set_pixel(im, i, j, k, clampedVal);
-      }
-    }
+  int n = im.w * im.h * im.c;
+  float *p = im.data;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    float v = p[i];
+    p[i] = v > 1 ? 1 : (v < 0 ? 0 : v);
   }
 }
 
@@ -89,101 +93,181 @@ float three_way_min(float a, float b, float c)
 }
 
 void rgb_to_hsv(image im) {
-  float red, green, blue;
-  float hue, saturation, value;
-  float minValue, C, Hprime;
-
-  for (int i = 0; i < im.w; i++) {
-    for (int j = 0; j < im.h; j++) {
-      red   = get_pixel(im, i, j, 0);
-      green = get_pixel(im, i, j, 1);
-      blue  = get_pixel(im, i, j, 2);
-
-      value    = three_way_max(red, green, blue);
-      minValue = three_way_min(red, green, blue);
-      C = value - minValue;
-
-      saturation = 0;
-      if (value != 0) {
-        saturation = C / value;
-      }
-
-      if (C == 0) {
-        Hprime = 0;
-      } else if (value == red) {
-        Hprime = (green - blue) / C;
-      } else if (value == green) {
-        Hprime = (blue - red) / C + 2;
-      } else { // value == blue
-        Hprime = (red - green) / C + 4;
-      }
-
-      hue = Hprime / 6;
-      if (Hprime < 0) {
-        hue += 1;
-      }
-
-      set_pixel(im, i, j, 0, hue);
-      set_pixel(im, i, j, 1, saturation);
-      set_pixel(im, i, j, 2, value);
+  assert(im.c == 3);
+  int n = im.w * im.h;
+  float *h = im.data;
+  float *s = im.data + n;
+  float *v = im.data + 2 * n;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    float red, green, blue;
+    float hue, saturation, value;
+    float minValue, C, Hprime;
+
+    red   = h[i];
+    green = s[i];
+    blue  = v[i];
+
+    value    = three_way_max(red, green, blue);
+    minValue = three_way_min(red, green, blue);
+    C = value - minValue;
+
+    saturation = 0;
+    if (value != 0) {
+      saturation = C / value;
+    }
+
+    if (C == 0) {
+      Hprime = 0;
+    } else if (value == red) {
+      Hprime = (green - blue) / C;
+    } else if (value == green) {
+      Hprime = (blue - red) / C + 2;
+    } else { // value == blue
+      Hprime = (red - green) / C + 4;
     }
+
+    hue = Hprime / 6;
+    if (Hprime < 0) {
+      hue += 1;
+    }
+
+    h[i] = hue;
+    s[i] = saturation;
+    v[i] = value;
   }
 }
 
 void hsv_to_rgb(image im) {
-  float hue, saturation, value;
-  float red, green, blue;
-  float minValue, chroma, Hprime, x;
-
-  for (int i = 0; i < im.w; i++) {
-    for (int j = 0; j < im.h; j++) {
-      hue        = get_pixel(im, i, j, 0);
-      saturation = get_pixel(im, i, j, 1);
-      value      = get_pixel(im, i, j, 2);
-
-      chroma = saturation * value;
-      minValue = value - chroma;
-      Hprime = hue * 6;
-      x = chroma * (1 - fabs(fmod(Hprime, 2) - 1));
-
-      if (Hprime < 1) {
-        red = chroma;
-        green = x;
-        blue = 0;
-      } else if (Hprime < 2) {
-        red = x;
-        green = chroma;
-        blue = 0;
-      } else if (Hprime < 3) {
-        red = 0;
-        green = chroma;
-        blue = x;
-      } else if (Hprime < 4) {
-        red = 0;
-        green = x;
-        blue = chroma;
-      } else if (Hprime < 5) {
-        red = x;
-        green = 0;
-        blue = chroma;
-      } else { // Hprime < 6
-        red = chroma;
-        green = 0;
-        blue = x;
-      }
-
-      set_pixel(im, i, j, 0, red + minValue);
-      set_pixel(im, i, j, 1, green + minValue);
-      set_pixel(im, i, j, 2, blue + minValue);
+  assert(im.c == 3);
+  int n = im.w * im.h;
+  float *r = im.data;
+  float *g = im.data + n;
+  float *b = im.data + 2 * n;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    float hue, saturation, value;
+    float red, green, blue;
+    float minValue, chroma, Hprime, x;
+
+    hue        = r[i];
+    saturation = g[i];
+    value      = b[i];
+
+    chroma = saturation * value;
+    minValue = value - chroma;
+    Hprime = hue * 6;
+    x = chroma * (1 - fabs(fmod(Hprime, 2) - 1));
+
+    if (Hprime < 1) {
+      red = chroma;
+      green = x;
+      blue = 0;
+    } else if (Hprime < 2) {
+      red = x;
+      green = chroma;
+      blue = 0;
+    } else if (Hprime < 3) {
+      red = 0;
+      green = chroma;
+      blue = x;
+    } else if (Hprime < 4) {
+      red = 0;
+      green = x;
+      blue = chroma;
+    } else if (Hprime < 5) {
+      red = x;
+      green = 0;
+      blue = chroma;
+    } else { // Hprime < 6
+      red = chroma;
+      green = 0;
+      blue = x;
     }
+
+    r[i] = red + minValue;
+    g[i] = green + minValue;
+    b[i] = blue + minValue;
   }
 }
 
 void scale_image(image im, int c, float v) {
-  for (int i = 0; i < im.w; i++) {
-    for (int j = 0; j < im.h; j++) {
-      float originalVal = get_pixel(im, i, j, c);
-      set_pixel(im, i, j, c, originalVal * v);
-    }
+  if (c < 0 || c >= im.c) return;
+  int n = im.w * im.h;
+  float *p = im.data + c * n;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    p[i] *= v;
   }
-}
\ No newline at end of file
+}
+
+
+// Branchless variants of the HSV conversions. Each channel is computed with
+// selects instead of the Hprime ladder so the loops vectorize; on x86 the
+// kernels are compiled for several instruction sets and the best one for the
+// running CPU is picked at load time. Other targets get the portable build,
+// which the compiler vectorizes for its baseline SIMD (e.g. NEON).
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define HSV_DISPATCH __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define HSV_DISPATCH
+#endif
+
+HSV_DISPATCH
+static void rgb_to_hsv_kernel(float *restrict h, float *restrict s,
+                              float *restrict v, int n) {
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    float red = h[i], green = s[i], blue = v[i];
+    float value = MAX(MAX(red, green), blue);
+    float minValue = MIN(MIN(red, green), blue);
+    float C = value - minValue;
+    float invC = C > 0 ? 1 / C : 0;
+
+    float hr = (green - blue) * invC;
+    float hg = (blue - red) * invC + 2;
+    float hb = (red - green) * invC + 4;
+    float Hprime = value == red ? hr : (value == green ? hg : hb);
+    Hprime = C > 0 ? Hprime : 0;
+
+    h[i] = Hprime / 6 + (Hprime < 0 ? 1 : 0);
+    s[i] = value != 0 ? C / (value != 0 ? value : 1) : 0;
+    v[i] = value;
+  }
+}
+
+HSV_DISPATCH
+static void hsv_to_rgb_kernel(float *restrict r, float *restrict g,
+                              float *restrict b, int n) {
+  // Each channel is v - C * clamp(min(k, 4 - k), 0, 1) where
+  // k = (offset + 6h) mod 6 and offset is 5, 3, 1 for red, green, blue.
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int i = 0; i < n; i++) {
+    float Hprime = r[i] * 6;
+    float value = b[i];
+    float chroma = g[i] * value;
+
+    float kr = 5 + Hprime;
+    float kg = 3 + Hprime;
+    float kb = 1 + Hprime;
+    kr -= 6 * floorf(kr / 6);
+    kg -= 6 * floorf(kg / 6);
+    kb -= 6 * floorf(kb / 6);
+
+    r[i] = value - chroma * MAX(0, MIN(MIN(kr, 4 - kr), 1));
+    g[i] = value - chroma * MAX(0, MIN(MIN(kg, 4 - kg), 1));
+    b[i] = value - chroma * MAX(0, MIN(MIN(kb, 4 - kb), 1));
+  }
+}
+
+void rgb_to_hsv_fast(image im) {
+  assert(im.c == 3);
+  int n = im.w * im.h;
+  rgb_to_hsv_kernel(im.data, im.data + n, im.data + 2 * n, n);
+}
+
+void hsv_to_rgb_fast(image im) {
+  assert(im.c == 3);
+  int n = im.w * im.h;
+  hsv_to_rgb_kernel(im.data, im.data + n, im.data + 2 * n, n);
+}
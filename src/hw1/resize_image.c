@@ -1,33 +1,16 @@
 #include <math.h>
+#include <stdlib.h>
 #include "image.h"
 
 float nn_interpolate(image im, float x, float y, int c) {
     return get_pixel(im, round(x), round(y), c);
 }
 
-image nn_resize(image im, int w, int h) {
-    float aw = (float)im.w / w;
-    float ah = (float)im.h / h;
-    float bw = 0.5 * (aw - 1);
-    float bh = 0.5 * (ah - 1);
-
-    image img = make_image(w, h, im.c);
-    for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
-        for (int k = 0; k < im.c; k++) {
-          float val = nn_interpolate(im, aw * i + bw, ah * j + bh, k);
-          set_pixel(img, i, j, k, val);
-        }
-      }
-    }
-    return img;
-}
-
 float bilinear_interpolate(image im, float x, float y, int c) {
     float x_floor = floor(x);
     float y_floor = floor(y);
-    float x_ceil = ceil(x);
-    float y_ceil = ceil(y);
+    float x_ceil = x_floor + 1;
+    float y_ceil = y_floor + 1;
 
     float d1 = x - x_floor;
     float d2 = x_ceil - x;
@@ -46,21 +29,248 @@ float bilinear_interpolate(image im, float x, float y, int c) {
     return q;
 }
 
-image bilinear_resize(image im, int w, int h) {
-    float aw = (float)im.w / w;
-    float ah = (float)im.h / h;
-    float bw = 0.5 * (aw - 1);
-    float bh = 0.5 * (ah - 1);
-
-    image img = make_image(w, h, im.c);
-    for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
-        for (int k = 0; k < im.c; k++) {
-          float val = bilinear_interpolate(im, aw * i + bw, ah * j + bh, k);
-          set_pixel(img, i, j, k, val);
+// Resampling along one axis as a table of source taps: output i reads
+// index[i*taps + t] (already clamped to the image) with weight[i*taps + t].
+// Building it once per axis replaces the per-pixel floor/ceil/get_pixel work.
+typedef struct {
+    int n;
+    int taps;
+    int *index;
+    float *weight;
+} resize_table;
+
+static resize_table make_resize_table(int n, int taps) {
+    resize_table t;
+    t.n = n;
+    t.taps = taps;
+    t.index = calloc(n * taps, sizeof(int));
+    t.weight = calloc(n * taps, sizeof(float));
+    return t;
+}
+
+static void free_resize_table(resize_table t) {
+    free(t.index);
+    free(t.weight);
+}
+
+static int clamp_coord(int x, int n) {
+    return x < 0 ? 0 : (x >= n ? n - 1 : x);
+}
+
+// Output pixel centers map to a*i + b in the source, as in nn/bilinear.
+static resize_table nn_table(int in, int out) {
+    float a = (float)in / out;
+    float b = 0.5 * (a - 1);
+    resize_table t = make_resize_table(out, 1);
+    for (int i = 0; i < out; i++) {
+        t.index[i] = clamp_coord(round(a * i + b), in);
+        t.weight[i] = 1;
+    }
+    return t;
+}
+
+static resize_table bilinear_table(int in, int out) {
+    float a = (float)in / out;
+    float b = 0.5 * (a - 1);
+    resize_table t = make_resize_table(out, 2);
+    for (int i = 0; i < out; i++) {
+        float x = a * i + b;
+        float x_floor = floor(x);
+        t.index[2 * i] = clamp_coord(x_floor, in);
+        t.index[2 * i + 1] = clamp_coord(x_floor + 1, in);
+        t.weight[2 * i] = x_floor + 1 - x;
+        t.weight[2 * i + 1] = x - x_floor;
+    }
+    return t;
+}
+
+// Each output pixel covers [i*s, (i+1)*s) of the source, s = in/out, and
+// averages the source pixels it overlaps weighted by the overlap.
+static resize_table area_table(int in, int out) {
+    double s = (double)in / out;
+    int taps = (int)ceil(s) + 1;
+    resize_table t = make_resize_table(out, taps);
+    for (int i = 0; i < out; i++) {
+        double lo = i * s;
+        double hi = (i + 1) * s;
+        int k0 = floor(lo);
+        for (int k = 0; k < taps; k++) {
+            double l = k0 + k > lo ? k0 + k : lo;
+            double h = k0 + k + 1 < hi ? k0 + k + 1 : hi;
+            t.index[i * taps + k] = clamp_coord(k0 + k, in);
+            t.weight[i * taps + k] = h > l ? (h - l) / s : 0;
         }
-      }
     }
+    return t;
+}
+
+// Kernels for resample_image, in source pixels at scale 1.
+static float bicubic_kernel(float x) {
+    const float a = -0.5;
+    x = fabsf(x);
+    if (x < 1) return ((a + 2) * x - (a + 3)) * x * x + 1;
+    if (x < 2) return ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+    return 0;
+}
+
+static float sinc(float x) {
+    if (x == 0) return 1;
+    x *= M_PI;
+    return sinf(x) / x;
+}
+
+static float lanczos3_kernel(float x) {
+    if (fabsf(x) >= 3) return 0;
+    return sinc(x) * sinc(x / 3);
+}
+
+// Samples a kernel around each output center. When shrinking, the kernel
+// is stretched by the reduction ratio so it also acts as the anti-alias
+// low-pass; weights are normalized so flat regions stay flat.
+static resize_table kernel_table(int in, int out, float (*kernel)(float),
+                                 float support) {
+    double scale = (double)in / out;
+    double fs = scale > 1 ? scale : 1;
+    double sup = support * fs;
+    int taps = 2 * (int)ceil(sup) + 1;
+    resize_table t = make_resize_table(out, taps);
+    for (int i = 0; i < out; i++) {
+        double center = (i + 0.5) * scale - 0.5;
+        int k0 = ceil(center - sup);
+        float sum = 0;
+        for (int k = 0; k < taps; k++) {
+            float wt = kernel((k0 + k - center) / fs);
+            t.index[i * taps + k] = clamp_coord(k0 + k, in);
+            t.weight[i * taps + k] = wt;
+            sum += wt;
+        }
+        if (sum != 0) {
+            for (int k = 0; k < taps; k++) t.weight[i * taps + k] /= sum;
+        }
+    }
+    return t;
+}
+
+// Horizontal pass: each row of src listed in used (by row index within a
+// channel, NULL for all) is resampled with tx into the same row of dst.
+static void resize_rows(image src, image dst, resize_table tx, const char *used) {
+    int w = dst.w;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < src.h * src.c; r++) {
+        if (used && !used[r % src.h]) continue;
+        const float *s = src.data + r * src.w;
+        float *d = dst.data + r * w;
+        for (int i = 0; i < w; i++) {
+            const int *idx = tx.index + i * tx.taps;
+            const float *wt = tx.weight + i * tx.taps;
+            float sum = 0;
+            for (int t = 0; t < tx.taps; t++) {
+                sum += s[idx[t]] * wt[t];
+            }
+            d[i] = sum;
+        }
+    }
+}
+
+// Vertical pass: accumulates whole source rows into each (zeroed) dst row,
+// so the inner loop is contiguous and vectorizes.
+static void resize_cols(image src, image dst, resize_table ty) {
+    int w = src.w;
+    int h = dst.h;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < h * src.c; r++) {
+        int k = r / h;
+        int j = r % h;
+        float *d = dst.data + r * w;
+        const float *plane = src.data + k * w * src.h;
+        for (int t = 0; t < ty.taps; t++) {
+            float wt = ty.weight[j * ty.taps + t];
+            if (wt == 0) continue;
+            const float *s = plane + ty.index[j * ty.taps + t] * w;
+            for (int i = 0; i < w; i++) {
+                d[i] += s[i] * wt;
+            }
+        }
+    }
+}
+
+// Applies tx along rows, then ty down columns. The horizontal pass only
+// visits source rows that ty references.
+static image resize_separable(image im, resize_table tx, resize_table ty) {
+    image tmp = make_image(tx.n, im.h, im.c);
+    image out = make_image(tx.n, ty.n, im.c);
+
+    char *used = calloc(im.h, 1);
+    for (int i = 0; i < ty.n * ty.taps; i++) {
+        if (ty.weight[i] != 0) used[ty.index[i]] = 1;
+    }
+    resize_rows(im, tmp, tx, used);
+    resize_cols(tmp, out, ty);
+
+    free(used);
+    free_image(tmp);
+    return out;
+}
+
+// Same as resize_separable but columns first, so a height reduction cuts
+// the rows the (gathering) horizontal pass has to touch.
+static image resize_separable_cols_first(image im, resize_table tx,
+                                         resize_table ty) {
+    image tmp = make_image(im.w, ty.n, im.c);
+    image out = make_image(tx.n, ty.n, im.c);
+    resize_cols(im, tmp, ty);
+    resize_rows(tmp, out, tx, 0);
+    free_image(tmp);
+    return out;
+}
+
+image nn_resize(image im, int w, int h) {
+    resize_table tx = nn_table(im.w, w);
+    resize_table ty = nn_table(im.h, h);
+    image img = resize_separable(im, tx, ty);
+    free_resize_table(tx);
+    free_resize_table(ty);
+    return img;
+}
+
+image bilinear_resize(image im, int w, int h) {
+    resize_table tx = bilinear_table(im.w, w);
+    resize_table ty = bilinear_table(im.h, h);
+    image img = resize_separable(im, tx, ty);
+    free_resize_table(tx);
+    free_resize_table(ty);
+    return img;
+}
+
+// Box-filter resize: every output pixel is the mean of the source area it
+// covers. Meant for large reductions (thumbnails) where bilinear aliases.
+image area_resize(image im, int w, int h) {
+    resize_table tx = area_table(im.w, w);
+    resize_table ty = area_table(im.h, h);
+    image img = resize_separable(im, tx, ty);
+    free_resize_table(tx);
+    free_resize_table(ty);
     return img;
 }
 
+// Anti-aliased resize with the given reconstruction filter. Downscaling
+// widens the filter by the reduction ratio, so there is no need to blur
+// before resizing.
+image resample_image(image im, int w, int h, RESAMPLE_FILTER filter) {
+    resize_table tx, ty;
+    if (filter == RESAMPLE_BICUBIC) {
+        tx = kernel_table(im.w, w, bicubic_kernel, 2);
+        ty = kernel_table(im.h, h, bicubic_kernel, 2);
+    } else if (filter == RESAMPLE_LANCZOS3) {
+        tx = kernel_table(im.w, w, lanczos3_kernel, 3);
+        ty = kernel_table(im.h, h, lanczos3_kernel, 3);
+    } else {
+        tx = area_table(im.w, w);
+        ty = area_table(im.h, h);
+    }
+    image img = h < im.h ? resize_separable_cols_first(im, tx, ty)
+                         : resize_separable(im, tx, ty);
+    free_resize_table(tx);
+    free_resize_table(ty);
+    return img;
+}
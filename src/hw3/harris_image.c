@@ -94,28 +94,202 @@ image make_1d_gaussian(float sigma) {
   return im;
 }
 
-// Smooths an image using separable Gaussian filter.
-// image im: image to smooth.
-// float sigma: std dev. for Gaussian.
-// returns: smoothed image.
-image smooth_image(image im, float sigma) {
+// Smooths an image with a truncated (6 sigma) separable Gaussian kernel.
+image smooth_image_convolve(image im, float sigma) {
   image row = make_1d_gaussian(sigma);
 
   // Transpose n x 1 Gaussian to 1 x n
   image col = make_image(1, row.w, 1);
-  for (int j = 0; j < im.h; j++) {
+  for (int j = 0; j < row.w; j++) {
     set_pixel(col, 0, j, 0, get_pixel(row, j, 0, 0));
   }
 
   // Apply the two filters one after the other
-  image s = convolve_image(convolve_image(im, row, 1), col, 1);
+  image r = convolve_image(im, row, 1);
+  image s = convolve_image(r, col, 1);
 
   // Clean up and return
+  free_image(r);
   free_image(row);
   free_image(col);
   return s;
 }
 
+static SMOOTH_MODE smooth_mode = SMOOTH_CONVOLVE;
+
+// Selects how smooth_image blurs: truncated separable kernels or the
+// recursive filter below, whose cost does not depend on sigma.
+void set_smooth_mode(SMOOTH_MODE mode) { smooth_mode = mode; }
+
+SMOOTH_MODE get_smooth_mode() { return smooth_mode; }
+
+// Young & van Vliet (1995) third-order recursive Gaussian. c[0] is the
+// input gain and c[1..3] the feedback weights (already divided by b0). m is
+// the 3x3 map from the causal pass's final state (minus the border value)
+// to the anti-causal pass's initial state, as in Triggs & Sdika (2006), so a
+// clamped border is handled exactly instead of being cut off.
+typedef struct {
+  float c[4];
+  float m[9];
+} yvv_filter;
+
+static yvv_filter make_yvv_filter(float sigma) {
+  yvv_filter f;
+  double q;
+  if (sigma >= 2.5) {
+    q = 0.98711 * sigma - 0.96330;
+  } else {
+    q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+  }
+  double q2 = q * q;
+  double q3 = q2 * q;
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+  double c[4];
+  c[1] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  c[2] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  c[3] = 0.422205 * q3 / b0;
+  c[0] = 1 - (c[1] + c[2] + c[3]);
+
+  // Past the border the input is constant, so only the deviation of the
+  // causal state decays through both passes. Run that tail out once per
+  // unit deviation; the poles fall off well within ~10 sigma.
+  int n = 10 * sigma + 32;
+  double *e = calloc(n + 3, sizeof(double));
+  double *g = calloc(n + 3, sizeof(double));
+  for (int k = 0; k < 3; k++) {
+    memset(e, 0, (n + 3) * sizeof(double));
+    memset(g, 0, (n + 3) * sizeof(double));
+    e[2 - k] = 1;
+    for (int i = 3; i < n + 3; i++) {
+      e[i] = c[1] * e[i - 1] + c[2] * e[i - 2] + c[3] * e[i - 3];
+    }
+    for (int i = n - 1; i >= 3; i--) {
+      g[i] = c[0] * e[i] + c[1] * g[i + 1] + c[2] * g[i + 2] +
+             c[3] * (i + 3 < n + 3 ? g[i + 3] : 0);
+    }
+    for (int r = 0; r < 3; r++) {
+      f.m[r * 3 + k] = g[3 + r];
+    }
+  }
+  free(e);
+  free(g);
+
+  for (int i = 0; i < 4; i++) {
+    f.c[i] = c[i];
+  }
+  return f;
+}
+
+// Causal then anti-causal pass over one row, in place. The causal pass is
+// primed with the first sample, which is exact for a clamped border.
+static void yvv_row(float *x, int n, const yvv_filter *f) {
+  const float *c = f->c;
+  float u = x[n - 1];
+  float w1 = x[0], w2 = x[0], w3 = x[0];
+  for (int i = 0; i < n; i++) {
+    float w = c[0] * x[i] + c[1] * w1 + c[2] * w2 + c[3] * w3;
+    w3 = w2;
+    w2 = w1;
+    w1 = w;
+    x[i] = w;
+  }
+  float d0 = x[n - 1] - u;
+  float d1 = x[n > 1 ? n - 2 : 0] - u;
+  float d2 = x[n > 2 ? n - 3 : 0] - u;
+  float y1 = u + f->m[0] * d0 + f->m[1] * d1 + f->m[2] * d2;
+  float y2 = u + f->m[3] * d0 + f->m[4] * d1 + f->m[5] * d2;
+  float y3 = u + f->m[6] * d0 + f->m[7] * d1 + f->m[8] * d2;
+  for (int i = n - 1; i >= 0; i--) {
+    float y = c[0] * x[i] + c[1] * y1 + c[2] * y2 + c[3] * y3;
+    y3 = y2;
+    y2 = y1;
+    y1 = y;
+    x[i] = y;
+  }
+}
+
+// Same recursion down the columns [x0, x1) of a plane. Rows are walked in
+// order with x innermost so every step reads contiguous memory. The first
+// causal output equals its input, so clamped row indices stand in for the
+// primed history; the anti-causal history past the last row is built from
+// the boundary map into three scratch rows.
+static void yvv_cols(float *p, int w, int h, int x0, int x1,
+                     const yvv_filter *f) {
+  const float *c = f->c;
+  int n = x1 - x0;
+  float *u = malloc(4 * n * sizeof(float));
+  float *v = u + n;
+  memcpy(u, p + (h - 1) * w + x0, n * sizeof(float));
+
+  for (int j = 1; j < h; j++) {
+    float *r = p + j * w;
+    const float *r1 = p + (j - 1) * w;
+    const float *r2 = p + (j > 1 ? j - 2 : 0) * w;
+    const float *r3 = p + (j > 2 ? j - 3 : 0) * w;
+    for (int i = x0; i < x1; i++) {
+      r[i] = c[0] * r[i] + c[1] * r1[i] + c[2] * r2[i] + c[3] * r3[i];
+    }
+  }
+
+  const float *l0 = p + (h - 1) * w + x0;
+  const float *l1 = p + (h > 1 ? h - 2 : 0) * w + x0;
+  const float *l2 = p + (h > 2 ? h - 3 : 0) * w + x0;
+  for (int k = 0; k < 3; k++) {
+    const float *m = f->m + 3 * k;
+    for (int i = 0; i < n; i++) {
+      v[k * n + i] = u[i] + m[0] * (l0[i] - u[i]) + m[1] * (l1[i] - u[i]) +
+                     m[2] * (l2[i] - u[i]);
+    }
+  }
+
+  for (int j = h - 1; j >= 0; j--) {
+    float *r = p + j * w + x0;
+    const float *r1 = j + 1 < h ? p + (j + 1) * w + x0 : v + (j + 1 - h) * n;
+    const float *r2 = j + 2 < h ? p + (j + 2) * w + x0 : v + (j + 2 - h) * n;
+    const float *r3 = j + 3 < h ? p + (j + 3) * w + x0 : v + (j + 3 - h) * n;
+    for (int i = 0; i < n; i++) {
+      r[i] = c[0] * r[i] + c[1] * r1[i] + c[2] * r2[i] + c[3] * r3[i];
+    }
+  }
+  free(u);
+}
+
+// Recursive Gaussian blur. Runs in constant time per pixel regardless of
+// sigma; sigmas below 0.5 fall outside the fitted range and use the kernel.
+image smooth_image_recursive(image im, float sigma) {
+  if (sigma < 0.5) {
+    return smooth_image_convolve(im, sigma);
+  }
+  yvv_filter f = make_yvv_filter(sigma);
+  image s = copy_image(im);
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int r = 0; r < im.h * im.c; r++) {
+    yvv_row(s.data + r * im.w, im.w, &f);
+  }
+
+  int bands = (im.w + 255) / 256;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int t = 0; t < bands * im.c; t++) {
+    int k = t / bands;
+    int x0 = (t % bands) * 256;
+    int x1 = x0 + 256 < im.w ? x0 + 256 : im.w;
+    yvv_cols(s.data + k * im.w * im.h, im.w, im.h, x0, x1, &f);
+  }
+  return s;
+}
+
+// Smooths an image using separable Gaussian filter.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian.
+// returns: smoothed image.
+image smooth_image(image im, float sigma) {
+  if (smooth_mode == SMOOTH_RECURSIVE) {
+    return smooth_image_recursive(im, sigma);
+  }
+  return smooth_image_convolve(im, sigma);
+}
+
 // Calculate the structure matrix of an image.
 // image im: the input image.
 // float sigma: std dev. to use for weighted sum.
@@ -124,23 +298,31 @@ image smooth_image(image im, float sigma) {
 image structure_matrix(image im, float sigma) {
   image S = make_image(im.w, im.h, 3);
 
-  // Calculcate image gradients
-  image gx = convolve_image(im, make_gx_filter(), 0);
-  image gy = convolve_image(im, make_gy_filter(), 0);
-
-  // Calculate each measure value
-  for (int i = 0; i < im.w; i++) {
+  // Calculate each measure value straight from the fused Sobel rows
+#pragma omp parallel num_threads(get_num_threads())
+  {
+    float *gx = malloc(im.w * sizeof(float));
+    float *gy = malloc(im.w * sizeof(float));
+#pragma omp for schedule(static)
     for (int j = 0; j < im.h; j++) {
-      float ix = get_pixel(gx, i, j, 0);
-      float iy = get_pixel(gy, i, j, 0);
-      set_pixel(S, i, j, 0, ix * ix);
-      set_pixel(S, i, j, 1, iy * iy);
-      set_pixel(S, i, j, 2, ix * iy);
+      sobel_gradient_row(im, j, gx, gy);
+      float *xx = S.data + j * im.w;
+      float *yy = xx + im.w * im.h;
+      float *xy = yy + im.w * im.h;
+      for (int i = 0; i < im.w; i++) {
+        xx[i] = gx[i] * gx[i];
+        yy[i] = gy[i] * gy[i];
+        xy[i] = gx[i] * gy[i];
+      }
     }
+    free(gx);
+    free(gy);
   }
 
   // Return the weighted sum via Gaussian blur
-  return smooth_image(S, sigma);
+  image smoothed = smooth_image(S, sigma);
+  free_image(S);
+  return smoothed;
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -150,15 +332,15 @@ image cornerness_response(image S) {
   image R = make_image(S.w, S.h, 1);
   // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
   float alpha = 0.06;
-  float sx, sy, sxy, det, trace;
-
-  for (int i = 0; i < R.w; i++) {
-    for (int j = 0; j < R.h; j++) {
-      sx = get_pixel(S, i, j, 0);
-      sy = get_pixel(S, i, j, 1);
-      sxy = get_pixel(S, i, j, 2);
-      det = sx * sy - sxy * sxy;
-      trace = sx + sy;
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int j = 0; j < R.h; j++) {
+    for (int i = 0; i < R.w; i++) {
+      float sx = get_pixel(S, i, j, 0);
+      float sy = get_pixel(S, i, j, 1);
+      float sxy = get_pixel(S, i, j, 2);
+      float det = sx * sy - sxy * sxy;
+      float trace = sx + sy;
       set_pixel(R, i, j, 0, det - alpha * trace * trace);
     }
   }
@@ -184,8 +366,9 @@ void suppress_pixel(image im, image r, int w, int x, int y) {
 // returns: image with only local-maxima responses within w pixels.
 image nms_image(image im, int w) {
   image r = copy_image(im);
-  for (int i = 0; i < r.w; i++) {
-    for (int j = 0; j < r.h; j++) {
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  for (int j = 0; j < r.h; j++) {
+    for (int i = 0; i < r.w; i++) {
       suppress_pixel(im, r, w, i, j);
     }
   }
@@ -246,4 +429,5 @@ void detect_and_draw_corners(image im, float sigma, float thresh, int nms) {
   int n = 0;
   descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
   mark_corners(im, d, n);
+  free_descriptors(d, n);
 }
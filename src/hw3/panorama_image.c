@@ -196,13 +196,15 @@ point project_point(matrix H, point p) {
 
   matrix h_squiggle = matrix_mult_matrix(H, c);
   float w_squiggle = h_squiggle.data[2][0];
+  float x_squiggle = h_squiggle.data[0][0];
+  float y_squiggle = h_squiggle.data[1][0];
+  free_matrix(c);
+  free_matrix(h_squiggle);
   if (w_squiggle == 0) {
     // Unclear what to do at infinity
     return p;
   }
 
-  float x_squiggle = h_squiggle.data[0][0];
-  float y_squiggle = h_squiggle.data[1][0];
   point q = make_point(x_squiggle / w_squiggle, y_squiggle / w_squiggle);
   return q;
 }
@@ -327,9 +329,18 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff) {
   for (; k > 0; k--) {
     randomize_matches(m, n);
     matrix Hb_candidate = compute_homography(m, 8);
+    if (!Hb_candidate.data) {
+      continue;
+    }
     e = model_inliers(Hb_candidate, m, n, thresh);
+    free_matrix(Hb_candidate);
     if (e > best) {
-      Hb = compute_homography(m, e);
+      matrix H = compute_homography(m, e);
+      if (!H.data) {
+        continue;
+      }
+      free_matrix(Hb);
+      Hb = H;
       best = e;
       if (best > cutoff) {
         break;
@@ -377,6 +388,7 @@ image combine_images(image a, image b, matrix H) {
 
   // Paste image a into the new image offset by dx and dy.
   for (k = 0; k < a.c; ++k) {
+#pragma omp parallel for schedule(static) private(i) num_threads(get_num_threads())
     for (j = 0; j < a.h; ++j) {
       for (i = 0; i < a.w; ++i) {
         set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
@@ -386,6 +398,7 @@ image combine_images(image a, image b, matrix H) {
 
   // Paste in image b as well.
   for (k = 0; k < c.c; ++k) {
+#pragma omp parallel for schedule(static) private(i) num_threads(get_num_threads())
     for (j = 0; j < c.h; ++j) {
       for (i = 0; i < c.w; ++i) {
         point bp = project_point(H, make_point(i + dx, j + dy));
@@ -396,6 +409,7 @@ image combine_images(image a, image b, matrix H) {
     }
   }
 
+  free_matrix(Hinv);
   return c;
 }
 
@@ -438,6 +452,7 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms,
 
   // Stitch the images together with the homography
   image comb = combine_images(a, b, H);
+  free_matrix(H);
   return comb;
 }
 
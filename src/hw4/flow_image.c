@@ -3,6 +3,8 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include "image.h"
 #include "matrix.h"
 
@@ -47,7 +49,37 @@ void draw_line(image im, float x, float y, float dx, float dy)
 image make_integral_image(image im)
 {
     image integ = make_image(im.w, im.h, im.c);
-    // TODO: fill in the integral image
+
+    // Row prefix sums, one row per iteration.
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int r = 0; r < im.h*im.c; ++r){
+        const float *src = im.data + r*im.w;
+        float *dst = integ.data + r*im.w;
+        double sum = 0;
+        for(int i = 0; i < im.w; ++i){
+            sum += src[i];
+            dst[i] = sum;
+        }
+    }
+
+    // Column sums down 256-wide bands with double accumulators, so large
+    // images don't drift. The inner loop is contiguous and vectorizes.
+    int bands = (im.w + 255)/256;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int t = 0; t < bands*im.c; ++t){
+        int k = t/bands;
+        int x0 = (t%bands)*256;
+        int n = MIN(256, im.w - x0);
+        double acc[256] = {0};
+        float *p = integ.data + k*im.w*im.h + x0;
+        for(int j = 0; j < im.h; ++j){
+            float *row = p + j*im.w;
+            for(int i = 0; i < n; ++i){
+                acc[i] += row[i];
+                row[i] = acc[i];
+            }
+        }
+    }
     return integ;
 }
 
@@ -55,12 +87,58 @@ image make_integral_image(image im)
 // image im: image to smooth
 // int s: window size for box filter
 // returns: smoothed image
+// Windows are clipped at the border and normalized by the pixels they
+// cover. Since that count is separable the filter runs as a horizontal and
+// a vertical running sum (double accumulators, add the entering sample and
+// drop the leaving one), so the cost per pixel does not depend on s.
 image box_filter_image(image im, int s)
 {
-    int i,j,k;
-    image integ = make_integral_image(im);
+    image H = make_image(im.w, im.h, im.c);
     image S = make_image(im.w, im.h, im.c);
-    // TODO: fill in S using the integral image.
+    int r = s/2;
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int q = 0; q < im.h*im.c; ++q){
+        const float *src = im.data + q*im.w;
+        float *dst = H.data + q*im.w;
+        double sum = 0;
+        for(int i = 0; i < r && i < im.w; ++i) sum += src[i];
+        for(int i = 0; i < im.w; ++i){
+            if(i + r < im.w) sum += src[i + r];
+            if(i - r - 1 >= 0) sum -= src[i - r - 1];
+            int n = MIN(i + r, im.w - 1) - MAX(i - r, 0) + 1;
+            dst[i] = sum/n;
+        }
+    }
+
+    int bands = (im.w + 255)/256;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int t = 0; t < bands*im.c; ++t){
+        int k = t/bands;
+        int x0 = (t%bands)*256;
+        int w = MIN(256, im.w - x0);
+        double acc[256] = {0};
+        const float *src = H.data + k*im.w*im.h + x0;
+        float *dst = S.data + k*im.w*im.h + x0;
+        for(int j = 0; j < r && j < im.h; ++j){
+            for(int i = 0; i < w; ++i) acc[i] += src[j*im.w + i];
+        }
+        for(int j = 0; j < im.h; ++j){
+            if(j + r < im.h){
+                const float *in = src + (j + r)*im.w;
+                for(int i = 0; i < w; ++i) acc[i] += in[i];
+            }
+            if(j - r - 1 >= 0){
+                const float *out = src + (j - r - 1)*im.w;
+                for(int i = 0; i < w; ++i) acc[i] -= out[i];
+            }
+            float norm = 1./(MIN(j + r, im.h - 1) - MAX(j - r, 0) + 1);
+            float *row = dst + j*im.w;
+            for(int i = 0; i < w; ++i) row[i] = acc[i]*norm;
+        }
+    }
+
+    free_image(H);
     return S;
 }
 
@@ -80,9 +158,24 @@ image time_structure_matrix(image im, image prev, int s)
         prev = rgb_to_grayscale(prev);
     }
 
-    // TODO: calculate gradients, structure components, and smooth them
-
-    image S;
+    image gx = convolve_image(im, get_filter(GX_FILTER, 0), 0);
+    image gy = convolve_image(im, get_filter(GY_FILTER, 0), 0);
+    image T = make_image(im.w, im.h, 5);
+    int n = im.w*im.h;
+    for(i = 0; i < n; ++i){
+        float ix = gx.data[i];
+        float iy = gy.data[i];
+        float it = im.data[i] - prev.data[i];
+        T.data[i + 0*n] = ix*ix;
+        T.data[i + 1*n] = iy*iy;
+        T.data[i + 2*n] = ix*iy;
+        T.data[i + 3*n] = ix*it;
+        T.data[i + 4*n] = iy*it;
+    }
+    image S = box_filter_image(T, s);
+    free_image(T);
+    free_image(gx);
+    free_image(gy);
 
     if(converted){
         free_image(im); free_image(prev);
@@ -90,31 +183,57 @@ image time_structure_matrix(image im, image prev, int s)
     return S;
 }
 
+static float flow_min_eig = 1e-6;
+
+// Set the conditioning threshold for velocity_image.
+// float t: pixels whose structure matrix has a smaller minimum eigenvalue
+//          are treated as unreliable (flat or edge-only neighbourhoods).
+void set_flow_min_eigenvalue(float t)
+{
+    flow_min_eig = t;
+}
+
 // Calculate the velocity given a structure image
 // image S: time-structure image
 // int stride: only calculate subset of pixels for speed
+// returns: vx, vy in channels 0 and 1. Channel 2 is 1 where the system was
+//          too poorly conditioned to solve; those pixels get zero velocity.
 image velocity_image(image S, int stride)
 {
     image v = make_image(S.w/stride, S.h/stride, 3);
-    int i, j;
-    matrix M = make_matrix(2,2);
-    for(j = (stride-1)/2; j < S.h; j += stride){
-        for(i = (stride-1)/2; i < S.w; i += stride){
-            float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
-            float Iyy = S.data[i + S.w*j + 1*S.w*S.h];
-            float Ixy = S.data[i + S.w*j + 2*S.w*S.h];
-            float Ixt = S.data[i + S.w*j + 3*S.w*S.h];
-            float Iyt = S.data[i + S.w*j + 4*S.w*S.h];
-
-            // TODO: calculate vx and vy using the flow equation
-            float vx = 0;
-            float vy = 0;
-
-            set_pixel(v, i/stride, j/stride, 0, vx);
-            set_pixel(v, i/stride, j/stride, 1, vy);
+    int n = S.w*S.h;
+    int vn = v.w*v.h;
+    int off = (stride-1)/2;
+    float min_eig = flow_min_eig;
+
+    // Closed-form inverse of [Ixx Ixy; Ixy Iyy], branch free so a whole
+    // row of pixels is solved with SIMD.
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int j = 0; j < v.h; ++j){
+        const float *xx = S.data + (j*stride + off)*S.w + off;
+        const float *yy = xx + n;
+        const float *xy = yy + n;
+        const float *xt = xy + n;
+        const float *yt = xt + n;
+        float *vx = v.data + j*v.w;
+        float *vy = vx + vn;
+        float *bad = vy + vn;
+        for(int i = 0; i < v.w; ++i){
+            float a = xx[i*stride];
+            float d = yy[i*stride];
+            float b = xy[i*stride];
+            float e = xt[i*stride];
+            float f = yt[i*stride];
+            float diff = a - d;
+            float lmin = .5f*(a + d - sqrtf(diff*diff + 4*b*b));
+            float det = a*d - b*b;
+            int ok = lmin > min_eig && det != 0;
+            float inv = ok ? 1/det : 0;
+            vx[i] = -(d*e - b*f)*inv;
+            vy[i] = -(a*f - b*e)*inv;
+            bad[i] = !ok;
         }
     }
-    free_matrix(M);
     return v;
 }
 
@@ -150,6 +269,131 @@ void constrain_image(image im, float v)
     }
 }
 
+// The Sobel filters in time_structure_matrix scale gradients by 8, so
+// velocity_image reports motion in units of 1/8 pixel.
+#define SOBEL_GAIN 8
+
+static int flow_levels = 1;
+static int flow_iters = 1;
+
+// Configure coarse-to-fine flow for optical_flow_images.
+// int levels: pyramid levels, 1 keeps the single-scale estimate.
+// int iters: warp/refine iterations per level.
+void set_flow_pyramid(int levels, int iters)
+{
+    flow_levels = levels < 1 ? 1 : levels;
+    flow_iters = iters < 1 ? 1 : iters;
+}
+
+// Sample a single channel image at x + v(x) with bilinear interpolation.
+static image warp_image(image im, image v)
+{
+    image w = make_image(im.w, im.h, 1);
+    int n = im.w*im.h;
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for(int j = 0; j < im.h; ++j){
+        for(int i = 0; i < im.w; ++i){
+            float x = i + v.data[i + j*im.w];
+            float y = j + v.data[i + j*im.w + n];
+            w.data[i + j*im.w] = bilinear_interpolate(im, x, y, 0);
+        }
+    }
+    return w;
+}
+
+// Coarse-to-fine flow between two grayscale pyramids, see
+// optical_flow_pyramid. Missing levels are built on demand.
+static image pyramid_flow(pyramid *pa, pyramid *pb, int smooth, int iters)
+{
+    image top = get_pyramid_level(pa, pa->n - 1);
+    get_pyramid_level(pb, pb->n - 1);
+    image v = make_image(top.w, top.h, 3);
+
+    int l, k, i;
+    for(l = pa->n - 1; l >= 0; --l){
+        image a = pa->levels[l];
+        image b = pb->levels[l];
+        if(v.w != a.w || v.h != a.h){
+            image up = bilinear_resize(v, a.w, a.h);
+            scale_image(up, 0, (float)a.w/v.w);
+            scale_image(up, 1, (float)a.h/v.h);
+            free_image(v);
+            v = up;
+        }
+        for(k = 0; k < iters; ++k){
+            image warped = warp_image(a, v);
+            image S = time_structure_matrix(warped, b, smooth);
+            image dv = velocity_image(S, 1);
+            constrain_image(dv, 6);
+            for(i = 0; i < 2*a.w*a.h; ++i) v.data[i] += SOBEL_GAIN*dv.data[i];
+            free_image(warped);
+            free_image(S);
+            free_image(dv);
+        }
+    }
+    return v;
+}
+
+// Dense pyramidal Lucas-Kanade flow. Flow is estimated at the coarsest
+// level, then at each finer level it is upsampled, the current image is
+// warped back by it and the residual motion is solved for and added.
+// image im: current image
+// image prev: previous image
+// int smooth: window size for the structure matrix at every level
+// int levels: number of pyramid levels
+// int iters: refinement iterations per level
+// returns: velocity at every pixel in pixels, vx and vy in channels 0 and 1
+image optical_flow_pyramid(image im, image prev, int smooth, int levels, int iters)
+{
+    int converted = 0;
+    if(im.c == 3){
+        converted = 1;
+        im = rgb_to_grayscale(im);
+        prev = rgb_to_grayscale(prev);
+    }
+    pyramid pa = make_pyramid(im, levels);
+    pyramid pb = make_pyramid(prev, levels);
+    image v = pyramid_flow(&pa, &pb, smooth, iters);
+    free_pyramid(pa);
+    free_pyramid(pb);
+    if(converted){
+        free_image(im); free_image(prev);
+    }
+    return v;
+}
+
+// Flow between the grayscale pyramids of two frames as optical_flow_images
+// reports it: one vector per stride x stride cell, smoothed. Single level
+// pyramids use the single-scale estimate.
+static image strided_flow(pyramid *pa, pyramid *pb, int smooth, int stride)
+{
+    image v;
+    if(pa->n > 1){
+        image dense = pyramid_flow(pa, pb, smooth, flow_iters);
+        v = make_image(dense.w/stride, dense.h/stride, 3);
+        int i, j, k;
+        for(k = 0; k < 2; ++k){
+            for(j = 0; j < v.h; ++j){
+                for(i = 0; i < v.w; ++i){
+                    int x = i*stride + (stride-1)/2;
+                    int y = j*stride + (stride-1)/2;
+                    set_pixel(v, i, j, k, get_pixel(dense, x, y, k)/SOBEL_GAIN);
+                }
+            }
+        }
+        free_image(dense);
+        constrain_image(v, 6 << (pa->n - 1));
+    } else {
+        image S = time_structure_matrix(pa->levels[0], pb->levels[0], smooth);
+        v = velocity_image(S, stride);
+        free_image(S);
+        constrain_image(v, 6);
+    }
+    image vs = smooth_image(v, 2);
+    free_image(v);
+    return vs;
+}
+
 // Calculate the optical flow between two images
 // image im: current image
 // image prev: previous image
@@ -158,47 +402,254 @@ void constrain_image(image im, float v)
 // returns: velocity matrix
 image optical_flow_images(image im, image prev, int smooth, int stride)
 {
-    image S = time_structure_matrix(im, prev, smooth);   
-    image v = velocity_image(S, stride);
-    constrain_image(v, 6);
-    image vs = smooth_image(v, 2);
-    free_image(v);
-    free_image(S);
-    return vs;
+    image a = im.c == 3 ? rgb_to_grayscale(im) : im;
+    image b = prev.c == 3 ? rgb_to_grayscale(prev) : prev;
+    pyramid pa = make_pyramid(a, flow_levels);
+    pyramid pb = make_pyramid(b, flow_levels);
+    image v = strided_flow(&pa, &pb, smooth, stride);
+    free_pyramid(pa);
+    free_pyramid(pb);
+    if(a.data != im.data) free_image(a);
+    if(b.data != prev.data) free_image(b);
+    return v;
+}
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000. + t.tv_nsec/1e6;
+}
+
+// Frames waiting between the capture thread and the flow loop. With two
+// slots the next frame is captured while the current one is processed.
+#define FLOW_RING 2
+
+typedef struct{
+    frame_source src;
+    void *src_ctx;
+    image slots[FLOW_RING];
+    int head, count;
+    int done, stop;
+    int captured;
+    double capture;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} flow_ring;
+
+static void *capture_loop(void *arg)
+{
+    flow_ring *r = arg;
+    for(;;){
+        pthread_mutex_lock(&r->lock);
+        while(r->count == FLOW_RING && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+        int stop = r->stop;
+        image *slot = r->slots + (r->head + r->count) % FLOW_RING;
+        pthread_mutex_unlock(&r->lock);
+        if(stop) break;
+
+        double t = now_ms();
+        int ok = r->src(r->src_ctx, slot);
+        t = now_ms() - t;
+
+        pthread_mutex_lock(&r->lock);
+        if(ok){
+            r->count++;
+            r->captured++;
+            r->capture += t;
+        } else {
+            r->done = 1;
+        }
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if(!ok) break;
+    }
+    return 0;
 }
 
+// Run optical flow over a stream of frames. Capture runs on its own thread
+// into a small ring of reused frame buffers while this thread computes flow.
+// The grayscale pyramid of each frame is kept for the next one, so every
+// frame is converted and downsampled once, and per-frame temporaries come
+// from an image pool that is reset after each frame.
+// frame_source src: fills the given frame, reusing its buffer when the
+//                   size matches; returns 0 at the end of the stream
+// flow_sink sink: gets each frame and its flow (as optical_flow_images
+//                 would compute it), must not keep either; nonzero stops
+// int smooth, stride: as in optical_flow_images
+// int div: downsampling factor applied to frames before computing flow
+// returns: mean time per frame spent in each stage, in milliseconds
+flow_stats run_flow_stream(frame_source src, void *src_ctx, flow_sink sink, void *sink_ctx,
+        int smooth, int stride, int div)
+{
+    flow_stats st = {0};
+    flow_ring r = {0};
+    r.src = src;
+    r.src_ctx = src_ctx;
+    pthread_mutex_init(&r.lock, 0);
+    pthread_cond_init(&r.cond, 0);
+    pthread_t thread;
+    if(pthread_create(&thread, 0, capture_loop, &r)){
+        fprintf(stderr, "Couldn't start capture thread\n");
+        pthread_mutex_destroy(&r.lock);
+        pthread_cond_destroy(&r.cond);
+        return st;
+    }
+
+    pyramid cur = {0}, prev = {0};
+    image_pool *pool = make_image_pool();
+    image_pool *old = use_image_pool(pool);
+    int seen = 0;
+    if(div < 1) div = 1;
+    for(;;){
+        double t0 = now_ms();
+        pthread_mutex_lock(&r.lock);
+        while(r.count == 0 && !r.done) pthread_cond_wait(&r.cond, &r.lock);
+        int got = r.count;
+        image frame = r.slots[r.head];
+        pthread_mutex_unlock(&r.lock);
+        if(!got) break;
+
+        // Pyramids outlive the pool reset, build them from the heap.
+        double t1 = now_ms();
+        image small = div > 1 ? nn_resize(frame, frame.w/div, frame.h/div) : frame;
+        image gray = small.c == 3 ? rgb_to_grayscale(small) : small;
+        use_image_pool(0);
+        if(!cur.levels) cur = make_pyramid(gray, flow_levels);
+        else update_pyramid(&cur, gray);
+        get_pyramid_level(&cur, cur.n - 1);
+        use_image_pool(pool);
+
+        double t2 = now_ms(), t3 = t2;
+        int stop = 0;
+        if(seen++){
+            image v = strided_flow(&cur, &prev, smooth, stride);
+            t3 = now_ms();
+            stop = sink(frame, v, sink_ctx);
+            st.frames++;
+            st.wait += t1 - t0;
+            st.prepare += t2 - t1;
+            st.flow += t3 - t2;
+            st.sink += now_ms() - t3;
+        }
+        reset_image_pool(pool);
+
+        pyramid swap = prev;
+        prev = cur;
+        cur = swap;
+
+        pthread_mutex_lock(&r.lock);
+        r.head = (r.head + 1) % FLOW_RING;
+        r.count--;
+        r.stop = stop;
+        pthread_cond_broadcast(&r.cond);
+        pthread_mutex_unlock(&r.lock);
+        if(stop) break;
+    }
+
+    pthread_join(thread, 0);
+    use_image_pool(old);
+    free_image_pool(pool);
+    if(cur.levels) free_pyramid(cur);
+    if(prev.levels) free_pyramid(prev);
+    int i;
+    for(i = 0; i < FLOW_RING; ++i) free_image(r.slots[i]);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.cond);
+
+    if(st.frames){
+        st.capture = r.capture/r.captured;
+        st.wait /= st.frames;
+        st.prepare /= st.frames;
+        st.flow /= st.frames;
+        st.sink /= st.frames;
+    }
+    return st;
+}
+
+void print_flow_stats(flow_stats st)
+{
+    printf("%d frames, per frame: capture %.2f ms, wait %.2f ms, prepare %.2f ms, flow %.2f ms, sink %.2f ms\n",
+            st.frames, st.capture, st.wait, st.prepare, st.flow, st.sink);
+}
+
+typedef struct{
+    frame_writer *out;
+    float scale;
+} flow_writer;
+
+static int write_flow_frame(image frame, image v, void *ctx)
+{
+    flow_writer *w = ctx;
+    if(!w->out) return 0;
+    image copy = copy_image(frame);
+    draw_flow(copy, v, w->scale);
+    clamp_image(copy);
+    write_frame(w->out, copy);
+    free_image(copy);
+    return 0;
+}
+
+// Run optical flow over frames on disk, the headless optical_flow_webcam.
+// const char *in: directory of images or .bin frame stream to read
+// const char *out: where to write frames with flow drawn on them, see
+//                  open_frame_writer, or 0 to only time the pipeline
+// int smooth, stride, div: as in optical_flow_webcam
+// returns: per-stage timing, frames is 0 if the frames couldn't be opened
+flow_stats optical_flow_files(const char *in, const char *out, int smooth, int stride, int div)
+{
+    flow_stats st = {0};
+    frame_reader *r = open_frame_reader(in);
+    if(!r) return st;
+    flow_writer w = {0, smooth*div};
+    if(out && !(w.out = open_frame_writer(out))){
+        close_frame_reader(r);
+        return st;
+    }
+    st = run_flow_stream(read_frame, r, write_flow_frame, &w, smooth, stride, div);
+    close_frame_writer(w.out);
+    close_frame_reader(r);
+    return st;
+}
+
+#ifdef OPENCV
+static int webcam_source(void *cap, image *frame)
+{
+    image im = get_image_from_stream(cap);
+    if(!im.data) return 0;
+    free_image(*frame);
+    *frame = im;
+    return 1;
+}
+
+static int webcam_sink(image frame, image v, void *scale)
+{
+    image copy = copy_image(frame);
+    draw_flow(copy, v, *(float *)scale);
+    int key = show_image(copy, "flow", 5);
+    free_image(copy);
+    if(key != -1) {
+        key = key % 256;
+        printf("%d\n", key);
+        if (key == 27) return 1;
+    }
+    return 0;
+}
+#endif
+
 // Run optical flow demo on webcam
 // int smooth: amount to smooth structure matrix by
 // int stride: downsampling for velocity matrix
-// int div: downsampling factor for images from webcam
+// int div: downsampling factor for images from webcam, with
+//          set_flow_pyramid this can stay at 1 even for fast motion
 void optical_flow_webcam(int smooth, int stride, int div)
 {
 #ifdef OPENCV
     void * cap;
     cap = open_video_stream(0, 0, 1280, 720, 30);
-    image prev = get_image_from_stream(cap);
-    image prev_c = nn_resize(prev, prev.w/div, prev.h/div);
-    image im = get_image_from_stream(cap);
-    image im_c = nn_resize(im, im.w/div, im.h/div);
-    while(im.data){
-        image copy = copy_image(im);
-        image v = optical_flow_images(im_c, prev_c, smooth, stride);
-        draw_flow(copy, v, smooth*div);
-        int key = show_image(copy, "flow", 5);
-        free_image(v);
-        free_image(copy);
-        free_image(prev);
-        free_image(prev_c);
-        prev = im;
-        prev_c = im_c;
-        if(key != -1) {
-            key = key % 256;
-            printf("%d\n", key);
-            if (key == 27) break;
-        }
-        im = get_image_from_stream(cap);
-        im_c = nn_resize(im, im.w/div, im.h/div);
-    }
+    float scale = smooth*div;
+    flow_stats st = run_flow_stream(webcam_source, cap, webcam_sink, &scale, smooth, stride, div);
+    print_flow_stats(st);
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
@@ -47,6 +47,17 @@ void gradient_matrix(matrix m, ACTIVATION a, matrix d)
     }
 }
 
+// Multiply matrices for a layer, in the layer's precision. Optional: using it
+// for the products in forward_layer and backward_layer lets a model set to
+// PRECISION_FLOAT run them in float.
+// matrix a, b: matrices to multiply
+// int ta, tb: whether to use the transpose of a and b instead
+// returns: op(a) * op(b)
+matrix layer_product(layer *l, matrix a, int ta, matrix b, int tb)
+{
+    return matrix_product(a, ta, b, tb, l->precision);
+}
+
 // Forward propagate information through a layer
 // layer *l: pointer to the layer
 // matrix in: input to layer
@@ -123,9 +134,18 @@ layer make_layer(int input, int output, ACTIVATION activation)
     l.v   = make_matrix(input, output);
     l.dw  = make_matrix(input, output);
     l.activation = activation;
+    l.precision = PRECISION_DOUBLE;
     return l;
 }
 
+// Set the precision every layer of a model multiplies in. Weights and
+// activations stay double, PRECISION_FLOAT only changes the products.
+void set_model_precision(model m, PRECISION p)
+{
+    int i;
+    for(i = 0; i < m.n; ++i) m.layers[i].precision = p;
+}
+
 // Run a model on input X
 // model m: model to run
 // matrix X: input to model
@@ -192,11 +212,17 @@ int max_index(double *a, int n)
 // returns: accuracy, number correct / total
 double accuracy_model(model m, data d)
 {
-    matrix p = forward_model(m, d.X);
-    int i;
+    int i, j;
     int correct = 0;
-    for(i = 0; i < d.y.rows; ++i){
-        if(max_index(d.y.data[i], d.y.cols) == max_index(p.data[i], p.cols)) ++correct;
+    // Inputs are widened to double and run through a chunk at a time.
+    for(i = 0; i < d.X.rows; i += 256){
+        int n = d.X.rows - i < 256 ? d.X.rows - i : 256;
+        matrix x = float_matrix_rows(d.X, i, n);
+        matrix p = forward_model(m, x);
+        for(j = 0; j < n; ++j){
+            if(max_index(d.y.data[i+j], d.y.cols) == max_index(p.data[j], p.cols)) ++correct;
+        }
+        free_matrix(x);
     }
     return (double)correct / d.y.rows;
 }
@@ -230,14 +256,15 @@ void train_model(model m, data d, int batch, int iters, double rate, double mome
 {
     int e;
     for(e = 0; e < iters; ++e){
-        data b = random_batch(d, batch);
+        minibatch b = random_batch(d, batch);
         matrix p = forward_model(m, b.X);
         fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss(b.y, p));
         matrix dL = axpy_matrix(-1, p, b.y); // partial derivative of loss dL/dy
         backward_model(m, dL);
         update_model(m, rate/batch, momentum, decay);
         free_matrix(dL);
-        free_data(b);
+        free_matrix(b.X);
+        free_matrix(b.y);
     }
 }
 
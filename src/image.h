@@ -53,6 +53,8 @@ image rgb_to_grayscale(image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
+void rgb_to_hsv_fast(image im);
+void hsv_to_rgb_fast(image im);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
 void clamp_image(image im);
@@ -61,6 +63,20 @@ int same_image(image a, image b, float eps);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Image pools
+typedef struct image_pool image_pool;
+image_pool *make_image_pool();
+image_pool *use_image_pool(image_pool *p);
+void reset_image_pool(image_pool *p);
+void free_image_pool(image_pool *p);
+int image_pool_blocks(image_pool *p);
+float *image_pool_alloc(size_t n);
+int image_pool_release(float *data);
+
+// Threading
+int get_num_threads();
+void set_num_threads(int n);
+
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
@@ -68,17 +84,41 @@ void save_image(image im, const char *name);
 void save_png(image im, const char *name);
 void save_image_binary(image im, const char *fname);
 image load_image_binary(const char *fname);
+int image_file_size(const char *filename);
+int load_image_row(const char *filename, float *row, int n);
+int load_image_into(const char *filename, image *im);
+image map_image_binary(const char *fname);
+int unmap_image_binary(float *data);
+int write_image_binary(image im, FILE *fp);
+int read_image_binary(FILE *fp, image *im);
+void bytes_to_image(const unsigned char *src, int stride, int bgr, image im);
+void image_to_bytes(image im, unsigned char *dst, int stride, int bgr);
 void save_png(image im, const char *name);
 void free_image(image im);
 
+// Frame sequences: a directory of images or a .bin stream of frames
+typedef struct frame_reader frame_reader;
+typedef struct frame_writer frame_writer;
+frame_reader *open_frame_reader(const char *path);
+int read_frame(void *reader, image *frame);
+void close_frame_reader(frame_reader *r);
+frame_writer *open_frame_writer(const char *path);
+void write_frame(frame_writer *w, image im);
+void close_frame_writer(frame_writer *w);
+
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+image area_resize(image im, int w, int h);
+typedef enum{RESAMPLE_AREA, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS3} RESAMPLE_FILTER;
+image resample_image(image im, int w, int h, RESAMPLE_FILTER filter);
 
 // Filtering
+typedef enum{CONV_AUTO, CONV_DIRECT, CONV_SEPARABLE, CONV_FFT} CONV_METHOD;
 image convolve_image(image im, image filter, int preserve);
+image convolve_image_method(image im, image filter, int preserve, CONV_METHOD method);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -90,8 +130,36 @@ void feature_normalize(image im);
 void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
+image *sobel_image_fast(image im);
+void sobel_gradient_row(image im, int y, float *gx, float *gy);
 image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
+typedef enum{SMOOTH_CONVOLVE, SMOOTH_RECURSIVE} SMOOTH_MODE;
+void set_smooth_mode(SMOOTH_MODE mode);
+SMOOTH_MODE get_smooth_mode();
+image smooth_image_convolve(image im, float sigma);
+image smooth_image_recursive(image im, float sigma);
+typedef enum{GX_FILTER, GY_FILTER, BOX_FILTER, GAUSSIAN_FILTER} FILTER_KIND;
+image get_filter(FILTER_KIND kind, float param);
+
+// Pyramids
+// int n: number of levels, level 0 is the full resolution image.
+// int built: levels [0, built) are up to date, the rest are made on demand.
+// image *levels: the levels, each half the size of the one before.
+typedef struct{
+    int n;
+    int built;
+    image *levels;
+} pyramid;
+image pyr_down(image im);
+void pyr_down_into(image src, image dst);
+image pyr_up(image im, int w, int h);
+pyramid make_pyramid(image im, int levels);
+image get_pyramid_level(pyramid *p, int level);
+void update_pyramid(pyramid *p, image im);
+void free_pyramid(pyramid p);
+pyramid make_laplacian_pyramid(image im, int levels);
+image collapse_laplacian_pyramid(pyramid p);
 
 // Harris and Stitching
 point make_point(float x, float y);
@@ -115,8 +183,25 @@ image make_integral_image(image im);
 image box_filter_image(image im, int s);
 image time_structure_matrix(image im, image prev, int s);
 image velocity_image(image S, int stride);
+void set_flow_min_eigenvalue(float t);
 image optical_flow_images(image im, image prev, int smooth, int stride);
+image optical_flow_pyramid(image im, image prev, int smooth, int levels, int iters);
+void set_flow_pyramid(int levels, int iters);
 void optical_flow_webcam(int smooth, int stride, int div);
+
+// Streaming flow: a source fills *frame (reusing its buffer when it can) and
+// returns 0 when the stream ends, a sink gets each frame with its flow and
+// returns nonzero to stop. Stats are mean milliseconds per frame.
+typedef int (*frame_source)(void *ctx, image *frame);
+typedef int (*flow_sink)(image frame, image v, void *ctx);
+typedef struct{
+    int frames;
+    double capture, wait, prepare, flow, sink;
+} flow_stats;
+flow_stats run_flow_stream(frame_source src, void *src_ctx, flow_sink sink, void *sink_ctx,
+        int smooth, int stride, int div);
+void print_flow_stats(flow_stats st);
+flow_stats optical_flow_files(const char *in, const char *out, int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
 
 #ifdef OPENCV
@@ -137,21 +222,30 @@ typedef struct {
     matrix v;               // Past weight updates (for use with momentum)
     matrix out;             // Saved output from the layer
     ACTIVATION activation;  // Activation the layer uses
+    PRECISION precision;    // Precision of the layer's matrix products
 } layer;
 
 typedef struct{
-    matrix X;
-    matrix y;
+    float_matrix X;         // Inputs, one example per row
+    matrix y;               // Labels, one per class for each example
 } data;
 
+typedef struct{
+    matrix X;               // Inputs of a training batch, widened to double
+    matrix y;
+} minibatch;
+
 typedef struct {
     layer *layers;
     int n;
 } model;
 
 data load_classification_data(char *images, char *label_file, int bias);
+int load_image_batch(char **paths, int n, float_matrix X, int cols, int *ok, int threads);
+void set_data_cache(int on);
+void set_data_cache_dir(const char *dir);
 void free_data(data d);
-data random_batch(data d, int n);
+minibatch random_batch(data d, int n);
 char *fgetl(FILE *fp);
 void activate_matrix(matrix m, ACTIVATION a);
 void gradient_matrix(matrix m, ACTIVATION a, matrix d);
@@ -159,6 +253,8 @@ matrix forward_layer(layer *l, matrix in);
 matrix backward_layer(layer *l, matrix delta);
 void update_layer(layer *l, double rate, double momentum, double decay);
 layer make_layer(int input, int output, ACTIVATION activation);
+matrix layer_product(layer *l, matrix a, int ta, matrix b, int tb);
+void set_model_precision(model m, PRECISION p);
 matrix load_matrix(const char *fname);
 void save_matrix(matrix m, const char *fname);
 
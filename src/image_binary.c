@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Binary images: a 64 byte header followed by the planar float data, so the
+// data of a file starts 64 byte aligned and map_image_binary can hand the
+// mapping out as an image without copying. The byte order mark is written
+// natively and reads back swapped on a machine of the other endianness. The
+// checksum is Fletcher-64 over the image data as 32-bit words in the
+// writer's byte order (so over the same float values on either end), not
+// counting any row padding.
+//
+// Files from before the header existed hold just int w, h, c and the data;
+// they're recognized by the missing magic and still load.
+
+#define BINARY_MAGIC "UWIM"
+#define BINARY_VERSION 1
+#define BINARY_BOM 0x01020304u
+#define BINARY_FLOAT32 0
+#define BINARY_HEADER 64
+
+typedef struct{
+    char magic[4];
+    uint16_t version;
+    uint16_t dtype;
+    uint32_t bom;
+    int32_t w, h, c;
+    int64_t stride;     // Floats from one row to the next
+    uint64_t offset;    // Bytes from the start of the header to the data
+    uint64_t checksum;
+    uint8_t pad[16];
+} binary_header;
+
+typedef char binary_header_is_64_bytes[sizeof(binary_header) == BINARY_HEADER ? 1 : -1];
+
+typedef struct{
+    uint64_t a, b;
+} fletcher64;
+
+static void fletcher64_update(fletcher64 *f, const uint32_t *words, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        // 65536 words at a time keep b from overflowing before reducing.
+        size_t end = n - i > 65536 ? i + 65536 : n;
+        for (; i < end; ++i) {
+            f->a += words[i];
+            f->b += f->a;
+        }
+        f->a %= 0xffffffffu;
+        f->b %= 0xffffffffu;
+    }
+}
+
+static uint64_t fletcher64_sum(fletcher64 f)
+{
+    return f.b << 32 | f.a;
+}
+
+static uint32_t swap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static uint64_t swap64(uint64_t x)
+{
+    return (uint64_t)swap32(x) << 32 | swap32(x >> 32);
+}
+
+static void swap_header(binary_header *hd)
+{
+    hd->version = hd->version >> 8 | hd->version << 8;
+    hd->dtype = hd->dtype >> 8 | hd->dtype << 8;
+    hd->bom = swap32(hd->bom);
+    hd->w = swap32(hd->w);
+    hd->h = swap32(hd->h);
+    hd->c = swap32(hd->c);
+    hd->stride = swap64(hd->stride);
+    hd->offset = swap64(hd->offset);
+    hd->checksum = swap64(hd->checksum);
+}
+
+// Whether w x h x c is an image make_image can hold.
+static int dims_ok(int64_t w, int64_t h, int64_t c)
+{
+    return w >= 0 && h >= 0 && c >= 0 && (uint64_t)w*h*c <= INT_MAX;
+}
+
+// Check a header that starts with the magic, fixing its byte order.
+// returns: 1 if it's native, -1 if the data needs swapping, 0 if unusable
+static int check_header(binary_header *hd)
+{
+    int order = 1;
+    if (hd->bom != BINARY_BOM) {
+        swap_header(hd);
+        order = -1;
+    }
+    if (hd->bom != BINARY_BOM) {
+        fprintf(stderr, "Bad byte order mark in binary image\n");
+        return 0;
+    }
+    if (hd->version > BINARY_VERSION || hd->dtype != BINARY_FLOAT32) {
+        fprintf(stderr, "Unsupported binary image version %d, dtype %d\n", hd->version, hd->dtype);
+        return 0;
+    }
+    if (!dims_ok(hd->w, hd->h, hd->c) || hd->stride < hd->w || hd->stride > INT_MAX ||
+            hd->offset < BINARY_HEADER) {
+        fprintf(stderr, "Bad binary image header\n");
+        return 0;
+    }
+    return order;
+}
+
+// Bytes from the current position to the end of a file.
+// returns: byte count, or -1 if fp isn't a regular file
+static int64_t bytes_left(FILE *fp)
+{
+    struct stat st;
+    long pos = ftell(fp);
+    if (pos < 0 || fstat(fileno(fp), &st) || !S_ISREG(st.st_mode)) return -1;
+    return (int64_t)st.st_size - pos;
+}
+
+// Write an image in the binary format at the current position of a file.
+// returns: 1 on success
+int write_image_binary(image im, FILE *fp)
+{
+    binary_header hd = {{0}};
+    size_t n = (size_t)im.w*im.h*im.c;
+    memcpy(hd.magic, BINARY_MAGIC, 4);
+    hd.version = BINARY_VERSION;
+    hd.dtype = BINARY_FLOAT32;
+    hd.bom = BINARY_BOM;
+    hd.w = im.w;
+    hd.h = im.h;
+    hd.c = im.c;
+    hd.stride = im.w;
+    hd.offset = BINARY_HEADER;
+    fletcher64 f = {0, 0};
+    fletcher64_update(&f, (const uint32_t *)im.data, n);
+    hd.checksum = fletcher64_sum(f);
+    return fwrite(&hd, sizeof(hd), 1, fp) == 1 &&
+        fwrite(im.data, sizeof(float), n, fp) == n;
+}
+
+// Read the next image in the binary format (or the legacy one) from a file,
+// reusing im's buffer when the size matches.
+// returns: 1 on success, 0 at the end of the file or on a bad image
+int read_image_binary(FILE *fp, image *im)
+{
+    binary_header hd;
+    int64_t left = bytes_left(fp);
+    if (fread(&hd, 12, 1, fp) != 1) return 0;
+    int order = 1;
+    uint64_t skip = 0;
+    if (memcmp(hd.magic, BINARY_MAGIC, 4)) {
+        int dims[3];
+        memcpy(dims, &hd, sizeof(dims));
+        memset(&hd, 0, sizeof(hd));
+        hd.w = dims[0];
+        hd.h = dims[1];
+        hd.c = dims[2];
+        hd.stride = hd.w;
+        hd.offset = 12;
+        if (!dims_ok(hd.w, hd.h, hd.c)) {
+            fprintf(stderr, "Not a binary image\n");
+            return 0;
+        }
+    } else {
+        if (fread((char *)&hd + 12, sizeof(hd) - 12, 1, fp) != 1) return 0;
+        if (!(order = check_header(&hd))) return 0;
+        skip = hd.offset - BINARY_HEADER;
+    }
+
+    // Everything up to the end of the last row has to be in the file before
+    // anything is allocated for it.
+    size_t rows = (size_t)hd.h*hd.c, i;
+    uint64_t need = rows ? hd.offset + ((rows - 1)*(uint64_t)hd.stride + hd.w)*sizeof(float) : hd.offset;
+    if (left >= 0 && need > (uint64_t)left) {
+        fprintf(stderr, "Truncated binary image\n");
+        return 0;
+    }
+    if (skip) fseek(fp, skip, SEEK_CUR);
+    if (im->w != hd.w || im->h != hd.h || im->c != hd.c || !im->data) {
+        free_image(*im);
+        *im = make_image(hd.w, hd.h, hd.c);
+    }
+
+    fletcher64 f = {0, 0};
+    for (i = 0; i < rows; ++i) {
+        float *row = im->data + i*hd.w;
+        if (fread(row, sizeof(float), hd.w, fp) != (size_t)hd.w) {
+            fprintf(stderr, "Truncated binary image\n");
+            return 0;
+        }
+        if (order < 0) {
+            uint32_t *w = (uint32_t *)row;
+            int j;
+            for (j = 0; j < hd.w; ++j) w[j] = swap32(w[j]);
+        }
+        fletcher64_update(&f, (const uint32_t *)row, hd.w);
+        if (hd.stride > hd.w) fseek(fp, (hd.stride - hd.w)*sizeof(float), SEEK_CUR);
+    }
+    if (hd.version && fletcher64_sum(f) != hd.checksum) {
+        fprintf(stderr, "Checksum mismatch in binary image\n");
+        return 0;
+    }
+    return 1;
+}
+
+void save_image_binary(image im, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if (!fp || !write_image_binary(im, fp)) fprintf(stderr, "Failed to write image %s\n", fname);
+    if (fp) fclose(fp);
+}
+
+image load_image_binary(const char *fname)
+{
+    image im = {0};
+    FILE *fp = fopen(fname, "rb");
+    if (!fp || !read_image_binary(fp, &im)) {
+        fprintf(stderr, "Cannot load binary image \"%s\"\n", fname);
+        free_image(im);
+        memset(&im, 0, sizeof(im));
+    }
+    if (fp) fclose(fp);
+    return im;
+}
+
+// Mapped images, so free_image can find and unmap them.
+typedef struct mapping{
+    float *data;
+    void *base;
+    size_t size;
+    struct mapping *next;
+} mapping;
+
+static mapping *mappings = 0;
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Open a binary image without reading it: the file is mapped copy-on-write
+// and the image points into the mapping, so pages load on first touch and
+// are shared with every other process mapping the same file. Writes to the
+// image stay private. The checksum isn't verified, load_image_binary does.
+// Files that can't be used in place (legacy, byte swapped or padded rows)
+// are loaded instead. free_image unmaps the image.
+image map_image_binary(const char *fname)
+{
+    binary_header hd;
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size < BINARY_HEADER ||
+            pread(fd, &hd, sizeof(hd), 0) != sizeof(hd) ||
+            memcmp(hd.magic, BINARY_MAGIC, 4) || check_header(&hd) != 1 ||
+            hd.stride != hd.w || hd.offset % sizeof(float) ||
+            hd.offset + (uint64_t)hd.w*hd.h*hd.c*sizeof(float) > (uint64_t)st.st_size) {
+        if (fd >= 0) close(fd);
+        return load_image_binary(fname);
+    }
+    void *base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return load_image_binary(fname);
+
+    image im;
+    im.w = hd.w;
+    im.h = hd.h;
+    im.c = hd.c;
+    im.data = (float *)((char *)base + hd.offset);
+    mapping *m = malloc(sizeof(mapping));
+    m->data = im.data;
+    m->base = base;
+    m->size = st.st_size;
+    pthread_mutex_lock(&mapping_lock);
+    m->next = mappings;
+    mappings = m;
+    pthread_mutex_unlock(&mapping_lock);
+    return im;
+}
+
+// Unmap data if it came from map_image_binary.
+// returns: 1 if it did and is now unmapped
+int unmap_image_binary(float *data)
+{
+    mapping *m = 0;
+    pthread_mutex_lock(&mapping_lock);
+    mapping **l;
+    for (l = &mappings; *l; l = &(*l)->next) {
+        if ((*l)->data == data) {
+            m = *l;
+            *l = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mapping_lock);
+    if (!m) return 0;
+    munmap(m->base, m->size);
+    free(m);
+    return 1;
+}
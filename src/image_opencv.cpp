@@ -11,35 +11,18 @@ extern "C" {
 
     Mat image_to_mat(image im)
     {
-        image copy = copy_image(im);
-        clamp_image(copy);
-        int i,j;
-        Mat m(im.h, im.w, CV_8UC3);
-        for(j = 0; j < im.h; ++j){
-            for(i = 0; i < im.w; ++i){
-                m.at<Vec3b>(j, i) = Vec3b( get_pixel(im, i, j, 2)*255,
-                        get_pixel(im, i, j, 1)*255,
-                        get_pixel(im, i, j, 0)*255);
-            }
-        }
+        im.c = im.c < 3 ? 1 : 3;
+        Mat m(im.h, im.w, im.c == 1 ? CV_8UC1 : CV_8UC3);
+        image_to_bytes(im, m.data, (int)m.step[0], 1);
         return m;
     }
 
     image mat_to_image(Mat m)
     {
-        image im = make_image(m.cols, m.rows, 3);
-        int i,j;
-        for(j = 0; j < im.h; ++j){
-            for(i = 0; i < im.w; ++i){
-                Vec3b intensity = m.at<Vec3b>(j, i);
-                float blue = intensity.val[0]/255.;
-                float green = intensity.val[1]/255.;
-                float red = intensity.val[2]/255.;
-                set_pixel(im, i, j, 0, red);
-                set_pixel(im, i, j, 1, green);
-                set_pixel(im, i, j, 2, blue);
-            }
-        }
+        if (m.depth() != CV_8U) m.convertTo(m, CV_8U, m.depth() == CV_16U ? 1/257. : 255.);
+        image im = make_image(m.cols, m.rows, m.channels());
+        bytes_to_image(m.data, (int)m.step[0], 1, im);
+        if (im.c == 4) im.c = 3;
         return im;
     }
 
@@ -50,8 +33,8 @@ extern "C" {
         else cap = new VideoCapture(c);
         if(!cap->isOpened()) return 0;
         if(w) cap->set(CAP_PROP_FRAME_WIDTH, w);
-        if(h) cap->set(CAP_PROP_FRAME_HEIGHT, w);
-        if(fps) cap->set(CAP_PROP_FPS, w);
+        if(h) cap->set(CAP_PROP_FRAME_HEIGHT, h);
+        if(fps) cap->set(CAP_PROP_FPS, fps);
         return (void *) cap;
     }
 
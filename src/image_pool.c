@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+// Image pools recycle image buffers so steady-state processing does not hit
+// the heap. While a pool is active, make_image takes a 64-byte aligned
+// buffer from the pool's free list for the matching size class (allocating
+// one only if the list is empty) and free_image hands it back.
+// reset_image_pool returns every buffer at once, e.g. at the end of a frame.
+// The active pool is per thread, so a helper thread (say, one capturing
+// frames) keeps allocating from the heap while another works from a pool.
+
+#define POOL_ALIGN 64
+#define POOL_MIN_SIZE 256
+#define POOL_CLASSES 160
+
+typedef struct{
+    float *data;
+    size_t size;
+    int cls;
+    int next;       // Next free block in the same size class, or -1
+    int in_use;
+} pool_block;
+
+struct image_pool{
+    pool_block *blocks;
+    int n, cap;
+    int free[POOL_CLASSES];  // Head of each size class' free list, or -1
+    int *table;              // Open addressing map from data to block + 1
+    int table_size;
+    image_pool *next;        // Next live pool
+};
+
+static __thread image_pool *active_pool = 0;
+static image_pool *live_pools = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Size classes start at POOL_MIN_SIZE bytes and have four steps per
+// doubling, so a buffer wastes at most 25% and every size is a multiple of
+// POOL_ALIGN.
+static int size_class(size_t bytes, size_t *size)
+{
+    size_t base = POOL_MIN_SIZE;
+    int cls = 0;
+    for(;;){
+        int q;
+        for(q = 0; q < 4; ++q, ++cls){
+            size_t s = base + q*(base/4);
+            if (s >= bytes) {
+                *size = s;
+                return cls;
+            }
+        }
+        base *= 2;
+    }
+}
+
+static size_t hash_pointer(const float *p, int table_size)
+{
+    uintptr_t h = (uintptr_t)p / POOL_ALIGN;
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (h >> 7) & (table_size - 1);
+}
+
+static void table_insert(image_pool *p, int index)
+{
+    size_t h = hash_pointer(p->blocks[index].data, p->table_size);
+    while (p->table[h]) h = (h + 1) & (p->table_size - 1);
+    p->table[h] = index + 1;
+}
+
+static int table_find(image_pool *p, const float *data)
+{
+    if (!p->table_size) return -1;
+    size_t h = hash_pointer(data, p->table_size);
+    while (p->table[h]) {
+        int index = p->table[h] - 1;
+        if (p->blocks[index].data == data) return index;
+        h = (h + 1) & (p->table_size - 1);
+    }
+    return -1;
+}
+
+static void grow_pool(image_pool *p)
+{
+    int i;
+    p->cap = p->cap ? 2*p->cap : 64;
+    p->blocks = realloc(p->blocks, p->cap*sizeof(pool_block));
+
+    free(p->table);
+    p->table_size = 2*p->cap;
+    p->table = calloc(p->table_size, sizeof(int));
+    for(i = 0; i < p->n; ++i) table_insert(p, i);
+}
+
+image_pool *make_image_pool()
+{
+    int i;
+    image_pool *p = calloc(1, sizeof(image_pool));
+    for(i = 0; i < POOL_CLASSES; ++i) p->free[i] = -1;
+    pthread_mutex_lock(&pool_lock);
+    p->next = live_pools;
+    live_pools = p;
+    pthread_mutex_unlock(&pool_lock);
+    return p;
+}
+
+// Make a pool the one make_image draws from.
+// image_pool *p: pool to use, or 0 to go back to plain heap allocation.
+// returns: the previously active pool.
+image_pool *use_image_pool(image_pool *p)
+{
+    image_pool *prev = active_pool;
+    active_pool = p;
+    return prev;
+}
+
+// Get a zeroed buffer of n floats from the active pool.
+// returns: the buffer, or 0 if no pool is active.
+float *image_pool_alloc(size_t n)
+{
+    image_pool *p = active_pool;
+    if (!p) return 0;
+    float *data;
+    size_t size;
+    int cls = size_class(n*sizeof(float), &size);
+    pthread_mutex_lock(&pool_lock);
+    int index = p->free[cls];
+    if (index >= 0) {
+        p->free[cls] = p->blocks[index].next;
+    } else {
+        if (p->n == p->cap) grow_pool(p);
+        index = p->n++;
+        p->blocks[index].data = aligned_alloc(POOL_ALIGN, size);
+        p->blocks[index].size = size;
+        p->blocks[index].cls = cls;
+        table_insert(p, index);
+    }
+    p->blocks[index].in_use = 1;
+    data = p->blocks[index].data;
+    pthread_mutex_unlock(&pool_lock);
+    memset(data, 0, n*sizeof(float));
+    return data;
+}
+
+// Give a buffer back to the pool it came from.
+// returns: 1 if a live pool owned the buffer, 0 otherwise.
+int image_pool_release(float *data)
+{
+    int owned = 0;
+    pthread_mutex_lock(&pool_lock);
+    image_pool *p;
+    for(p = live_pools; p && !owned; p = p->next){
+        int index = table_find(p, data);
+        if (index < 0) continue;
+        owned = 1;
+        pool_block *b = p->blocks + index;
+        if (b->in_use) {
+            b->in_use = 0;
+            b->next = p->free[b->cls];
+            p->free[b->cls] = index;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return owned;
+}
+
+// Return every buffer to the pool. Images made from it must not be used
+// afterwards.
+void reset_image_pool(image_pool *p)
+{
+    int i;
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < POOL_CLASSES; ++i) p->free[i] = -1;
+    for(i = 0; i < p->n; ++i){
+        pool_block *b = p->blocks + i;
+        b->in_use = 0;
+        b->next = p->free[b->cls];
+        p->free[b->cls] = i;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Number of buffers the pool has taken from the heap.
+int image_pool_blocks(image_pool *p)
+{
+    return p->n;
+}
+
+void free_image_pool(image_pool *p)
+{
+    int i;
+    if (active_pool == p) active_pool = 0;
+    pthread_mutex_lock(&pool_lock);
+    image_pool **l = &live_pools;
+    while (*l != p) l = &(*l)->next;
+    *l = p->next;
+    pthread_mutex_unlock(&pool_lock);
+    for(i = 0; i < p->n; ++i) free(p->blocks[i].data);
+    free(p->blocks);
+    free(p->table);
+    free(p);
+}
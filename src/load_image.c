@@ -17,7 +17,8 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = image_pool_alloc((size_t)h*w*c);
+    if (!out.data) out.data = calloc(h*w*c, sizeof(float));
     return out;
 }
 
@@ -26,16 +27,180 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// 8-bit sample to float as v*(1.f/255), the same product the SIMD path
+// computes, so results don't depend on the CPU or the image width.
+#define BYTE1(i) ((float)(i)*(1.f/255))
+#define BYTE4(i) BYTE1(i), BYTE1(i+1), BYTE1(i+2), BYTE1(i+3)
+#define BYTE16(i) BYTE4(i), BYTE4(i+4), BYTE4(i+8), BYTE4(i+12)
+#define BYTE64(i) BYTE16(i), BYTE16(i+16), BYTE16(i+32), BYTE16(i+48)
+static const float byte_to_float[256] = {BYTE64(0), BYTE64(64), BYTE64(128), BYTE64(192)};
+
+static inline unsigned char float_to_byte(float x)
+{
+    float v = x*255;
+    v = v < 0 ? 0 : (v > 255 ? 255 : v);
+    return (unsigned char)(v + .5f);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Three-channel rows are (de)interleaved 16 pixels at a time with pshufb:
+// each output register is the OR of three shuffles, one per 16-byte input.
+// SSSE3 isn't in the x86-64 baseline, so these are compiled for it
+// separately and only used when the CPU has it.
+#define RGB_SIMD
+
+__attribute__((target("ssse3")))
+static int bytes_to_rgb_ssse3(const unsigned char *src, float *r, float *g, float *b, int n)
+{
+    const __m128i m[3][3] = {
+        {_mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)},
+        {_mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)},
+        {_mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+         _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)}};
+    const __m128 scale = _mm_set1_ps(1.f/255);
+    const __m128i zero = _mm_setzero_si128();
+    float *dst[3] = {r, g, b};
+    int i, k;
+    for(i = 0; i + 16 <= n; i += 16){
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + 3*i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + 3*i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(src + 3*i + 32));
+        for(k = 0; k < 3; ++k){
+            __m128i c = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m[k][0]),
+                        _mm_shuffle_epi8(v1, m[k][1])), _mm_shuffle_epi8(v2, m[k][2]));
+            __m128i lo = _mm_unpacklo_epi8(c, zero);
+            __m128i hi = _mm_unpackhi_epi8(c, zero);
+            float *d = dst[k] + i;
+            _mm_storeu_ps(d, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+            _mm_storeu_ps(d + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+            _mm_storeu_ps(d + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+            _mm_storeu_ps(d + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+        }
+    }
+    return i;
+}
+
+// Clamp, round and narrow 16 floats to bytes, the same as float_to_byte.
+__attribute__((target("ssse3")))
+static inline __m128i floats_to_bytes(const float *x)
+{
+    const __m128 scale = _mm_set1_ps(255);
+    const __m128 lo = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(.5f);
+    __m128i q[4];
+    int k;
+    for(k = 0; k < 4; ++k){
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(x + 4*k), scale);
+        v = _mm_add_ps(_mm_min_ps(_mm_max_ps(v, lo), scale), half);
+        q[k] = _mm_cvttps_epi32(v);
+    }
+    return _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+}
+
+__attribute__((target("ssse3")))
+static int rgb_to_bytes_ssse3(const float *r, const float *g, const float *b, unsigned char *dst, int n)
+{
+    const __m128i m[3][3] = {
+        {_mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5),
+         _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1),
+         _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)},
+        {_mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1),
+         _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10),
+         _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)},
+        {_mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1),
+         _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1),
+         _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)}};
+    int i, k;
+    for(i = 0; i + 16 <= n; i += 16){
+        __m128i c0 = floats_to_bytes(r + i);
+        __m128i c1 = floats_to_bytes(g + i);
+        __m128i c2 = floats_to_bytes(b + i);
+        for(k = 0; k < 3; ++k){
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m[k][0]),
+                        _mm_shuffle_epi8(c1, m[k][1])), _mm_shuffle_epi8(c2, m[k][2]));
+            _mm_storeu_si128((__m128i *)(dst + 3*i + 16*k), v);
+        }
+    }
+    return i;
+}
+#endif
+
+// Convert 8-bit interleaved pixels (as stb and OpenCV store them) to a planar
+// float image in one pass, scaling by 1/255. Rows are stride bytes apart and
+// bgr swaps channels 0 and 2, for OpenCV's BGR order.
+void bytes_to_image(const unsigned char *src, int stride, int bgr, image im)
+{
+    int i, j, k;
+    int plane = im.w*im.h;
+#ifdef RGB_SIMD
+    int simd = im.c == 3 && __builtin_cpu_supports("ssse3");
+#endif
+    for(j = 0; j < im.h; ++j){
+        const unsigned char *row = src + (size_t)j*stride;
+        float *dst = im.data + j*im.w;
+        if(im.c == 3){
+            float *r = dst + (bgr ? 2*plane : 0);
+            float *g = dst + plane;
+            float *b = dst + (bgr ? 0 : 2*plane);
+            i = 0;
+#ifdef RGB_SIMD
+            if(simd) i = bytes_to_rgb_ssse3(row, r, g, b, im.w);
+#endif
+            for(; i < im.w; ++i){
+                r[i] = byte_to_float[row[3*i+0]];
+                g[i] = byte_to_float[row[3*i+1]];
+                b[i] = byte_to_float[row[3*i+2]];
+            }
+        } else {
+            for(k = 0; k < im.c; ++k){
+                int kk = (bgr && k < 3 && im.c >= 3) ? 2-k : k;
+                float *d = dst + kk*plane;
+                for(i = 0; i < im.w; ++i) d[i] = byte_to_float[row[im.c*i+k]];
+            }
+        }
+    }
+}
+
+// Convert a planar float image to 8-bit interleaved pixels, the inverse of
+// bytes_to_image. Values are clamped to [0,1] and rounded as they're stored.
+void image_to_bytes(image im, unsigned char *dst, int stride, int bgr)
+{
+    int i, j, k;
+    int plane = im.w*im.h;
+#ifdef RGB_SIMD
+    int simd = im.c == 3 && __builtin_cpu_supports("ssse3");
+#endif
+    for(j = 0; j < im.h; ++j){
+        unsigned char *row = dst + (size_t)j*stride;
+        i = 0;
+#ifdef RGB_SIMD
+        if(simd){
+            const float *src = im.data + j*im.w;
+            i = rgb_to_bytes_ssse3(src + (bgr ? 2*plane : 0), src + plane,
+                    src + (bgr ? 0 : 2*plane), row, im.w);
+        }
+#endif
+        for(k = 0; k < im.c; ++k){
+            int kk = (bgr && k < 3 && im.c >= 3) ? 2-k : k;
+            const float *src = im.data + kk*plane + j*im.w;
+            int x;
+            for(x = i; x < im.w; ++x) row[im.c*x+k] = float_to_byte(src[x]);
+        }
+    }
+}
+
 void save_image_stb(image im, const char *name, int png)
 {
     char buff[256];
     unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-        }
-    }
+    image_to_bytes(im, data, im.w*im.c, 0);
     int success = 0;
     if(png){
         sprintf(buff, "%s.png", name);
@@ -73,56 +238,82 @@ image load_image_stb(char *filename, int channels)
         exit(0);
     }
     if (channels) c = channels;
-    int i,j,k;
     image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
+    bytes_to_image(data, w*c, 0, im);
     //We don't like alpha channels, #YOLO
     if(im.c == 4) im.c = 3;
     free(data);
     return im;
 }
 
-image load_image(char *filename)
+// Number of values load_image would give for a file, from its header only.
+// returns: w*h*c, or 0 if the file can't be read
+int image_file_size(const char *filename)
 {
-    image out = load_image_stb(filename, 0);
-    return out;
+    int w, h, c;
+    if (!stbi_info(filename, &w, &h, &c)) return 0;
+    if (c == 4) c = 3;
+    return w*h*c;
 }
 
-void save_image_binary(image im, const char *fname)
+// Decode an image straight into a row of floats, in the layout load_image
+// uses. Unlike load_image, a bad file is reported rather than fatal.
+// float *row: destination for n values
+// returns: 1 on success, 0 if the file can't be decoded or isn't n values
+int load_image_row(const char *filename, float *row, int n)
 {
-    FILE *fp = fopen(fname, "wb");
-    fwrite(&im.w, sizeof(int), 1, fp);
-    fwrite(&im.h, sizeof(int), 1, fp);
-    fwrite(&im.c, sizeof(int), 1, fp);
-    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
+    int w, h, c, i, k;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) return 0;
+    int keep = c == 4 ? 3 : c;
+    if (w*h*keep != n) {
+        stbi_image_free(data);
+        return 0;
+    }
+    for(k = 0; k < keep; ++k){
+        float *dst = row + k*w*h;
+        for(i = 0; i < w*h; ++i) dst[i] = byte_to_float[data[i*c + k]];
+    }
+    stbi_image_free(data);
+    return 1;
 }
 
-image load_image_binary(const char *fname)
+// Decode an image into *im, reusing its buffer when the size matches. Like
+// load_image_row, and unlike load_image, a bad file isn't fatal.
+// returns: 1 on success, 0 if the file can't be decoded (im is unchanged)
+int load_image_into(const char *filename, image *im)
 {
-    int w = 0;
-    int h = 0;
-    int c = 0;
-    FILE *fp = fopen(fname, "rb");
-    fread(&w, sizeof(int), 1, fp);
-    fread(&h, sizeof(int), 1, fp);
-    fread(&c, sizeof(int), 1, fp);
-    image im = make_image(w,h,c);
-    fread(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
-    return im;
+    int w, h, c, i;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) return 0;
+    int keep = c == 4 ? 3 : c;
+    if (c == 4) {
+        // Drop alpha in place, each pixel moves down or stays put.
+        for(i = 0; i < w*h; ++i){
+            data[3*i+0] = data[4*i+0];
+            data[3*i+1] = data[4*i+1];
+            data[3*i+2] = data[4*i+2];
+        }
+    }
+    if (im->w != w || im->h != h || im->c != keep || !im->data) {
+        free_image(*im);
+        *im = make_image(w, h, keep);
+    }
+    bytes_to_image(data, w*keep, 0, *im);
+    stbi_image_free(data);
+    return 1;
+}
+
+image load_image(char *filename)
+{
+    image out = load_image_stb(filename, 0);
+    return out;
 }
 
 void free_image(image im)
 {
+    if (im.data && image_pool_release(im.data)) return;
+    if (im.data && unmap_image_binary(im.data)) return;
     free(im.data);
 }
 
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include "image.h"
 #include "test.h"
@@ -8,6 +9,8 @@ int main(int argc, char **argv)
 {
     if(argc < 3){
         printf("usage: %s test <hw0 | hw1...>\n", argv[0]);  
+        printf("       %s flow <frames> [out] [-smooth 15] [-stride 8] [-div 1] [-levels 1] [-iters 1]\n", argv[0]);
+        printf("       %s gemm <m> [k 785] [n 32] [-iters 100]\n", argv[0]);
     } else if (0 == strcmp(argv[1], "test")){
         if (0 == strcmp(argv[2], "hw0")) test_hw0();
         if (0 == strcmp(argv[2], "hw1")) test_hw1();
@@ -15,6 +18,21 @@ int main(int argc, char **argv)
         if (0 == strcmp(argv[2], "hw3")) test_hw3();
         if (0 == strcmp(argv[2], "hw4")) test_hw4();
         if (0 == strcmp(argv[2], "hw5")) test_hw5();
+    } else if (0 == strcmp(argv[1], "flow")){
+        int smooth = find_int_arg(argc, argv, "-smooth", 15);
+        int stride = find_int_arg(argc, argv, "-stride", 8);
+        int div = find_int_arg(argc, argv, "-div", 1);
+        int levels = find_int_arg(argc, argv, "-levels", 1);
+        int iters = find_int_arg(argc, argv, "-iters", 1);
+        set_flow_pyramid(levels, iters);
+        char *out = argc > 3 ? argv[3] : 0;
+        print_flow_stats(optical_flow_files(argv[2], out, smooth, stride, div));
+    } else if (0 == strcmp(argv[1], "gemm")){
+        int iters = find_int_arg(argc, argv, "-iters", 100);
+        int m = atoi(argv[2]);
+        int k = argc > 3 && argv[3] ? atoi(argv[3]) : 785;
+        int n = argc > 4 && argv[4] ? atoi(argv[4]) : 32;
+        bench_gemm(m, k, n, iters);
     }
     return 0;
 }
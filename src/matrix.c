@@ -24,11 +24,16 @@ matrix make_translation_homography(float dx, float dy)
 
 void free_matrix(matrix m)
 {
-    if (m.data) {
-        int i;
-        if (!m.shallow) for(i = 0; i < m.rows; ++i) free(m.data[i]);
-        free(m.data);
-    }
+    if (!m.shallow) free(m.vals);
+    free(m.data);
+}
+
+// Point data at the rows of vals.
+static void set_rows(matrix *m)
+{
+    int i;
+    m->data = calloc(m->rows, sizeof(double *));
+    for(i = 0; i < m->rows; ++i) m->data[i] = m->vals + (size_t)i*m->stride;
 }
 
 matrix make_matrix(int rows, int cols)
@@ -37,20 +42,71 @@ matrix make_matrix(int rows, int cols)
     m.rows = rows;
     m.cols = cols;
     m.shallow = 0;
-    m.data = calloc(m.rows, sizeof(double *));
-    int i;
-    for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    m.stride = cols;
+    m.vals = calloc((size_t)rows*cols, sizeof(double));
+    set_rows(&m);
+    return m;
+}
+
+// A view of a block of m that shares its values, so writes go to m. It stays
+// valid as long as m does, and free_matrix on it only frees the row pointers.
+// int row, col: top left corner of the block
+// int rows, cols: size of the block
+matrix matrix_view(matrix m, int row, int col, int rows, int cols)
+{
+    assert(row >= 0 && col >= 0 && row + rows <= m.rows && col + cols <= m.cols);
+    matrix v;
+    v.rows = rows;
+    v.cols = cols;
+    v.shallow = 1;
+    v.stride = m.stride;
+    v.vals = m.vals + (size_t)row*m.stride + col;
+    set_rows(&v);
+    return v;
+}
+
+float_matrix make_float_matrix(int rows, int cols)
+{
+    float_matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.vals = calloc((size_t)rows*cols, sizeof(float));
     return m;
 }
 
+void free_float_matrix(float_matrix m)
+{
+    free(m.vals);
+}
+
+// Widen rows [row, row+rows) of a float matrix into a new matrix.
+matrix float_matrix_rows(float_matrix m, int row, int rows)
+{
+    assert(row >= 0 && row + rows <= m.rows);
+    matrix c = make_matrix(rows, m.cols);
+    const float *src = m.vals + (size_t)row*m.cols;
+    size_t i, n = (size_t)rows*m.cols;
+    for(i = 0; i < n; ++i) c.vals[i] = src[i];
+    return c;
+}
+
+// Swap the contents of two rows, keeping data[i] at vals + i*stride.
+static void swap_rows(matrix m, int a, int b)
+{
+    int j;
+    for(j = 0; j < m.cols; ++j){
+        double t = m.data[a][j];
+        m.data[a][j] = m.data[b][j];
+        m.data[b][j] = t;
+    }
+}
+
 matrix copy_matrix(matrix m)
 {
-    int i,j;
+    int i;
     matrix c = make_matrix(m.rows, m.cols);
     for(i = 0; i < m.rows; ++i){
-        for(j = 0; j < m.cols; ++j){
-            c.data[i][j] = m.data[i][j];
-        }
+        memcpy(c.data[i], m.data[i], m.cols*sizeof(double));
     }
     return c;
 }
@@ -80,19 +136,35 @@ matrix make_identity(int rows, int cols)
     return m;
 }
 
+// op(a) * op(b), where op transposes its matrix (without building the
+// transpose) when ta or tb is set.
+// PRECISION p: precision to multiply in, the result is double either way
+matrix matrix_product(matrix a, int ta, matrix b, int tb, PRECISION p)
+{
+    int rows = ta ? a.cols : a.rows;
+    int inner = ta ? a.rows : a.cols;
+    int cols = tb ? b.rows : b.cols;
+    assert(inner == (tb ? b.cols : b.rows));
+    matrix c = make_matrix(rows, cols);
+    gemm(ta, tb, rows, cols, inner, a.vals, a.stride, b.vals, b.stride, c.vals, c.stride, p);
+    return c;
+}
+
 matrix matrix_mult_matrix(matrix a, matrix b)
 {
-    assert(a.cols == b.rows);
-    int i, j, k;
-    matrix p = make_matrix(a.rows, b.cols);
-    for(i = 0; i < p.rows; ++i){
-        for(j = 0; j < p.cols; ++j){
-            for(k = 0; k < a.cols; ++k){
-                p.data[i][j] += a.data[i][k]*b.data[k][j];
-            }
-        }
-    }
-    return p;
+    return matrix_product(a, 0, b, 0, PRECISION_DOUBLE);
+}
+
+// a^T * b
+matrix transpose_mult_matrix(matrix a, matrix b)
+{
+    return matrix_product(a, 1, b, 0, PRECISION_DOUBLE);
+}
+
+// a * b^T
+matrix matrix_mult_transpose(matrix a, matrix b)
+{
+    return matrix_product(a, 0, b, 1, PRECISION_DOUBLE);
 }
 
 matrix matrix_elmult_matrix(matrix a, matrix b)
@@ -139,14 +211,9 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
-    matrix t;
-    t.rows = m.cols;
-    t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
-    t.shallow = 0;
+    matrix t = make_matrix(m.cols, m.rows);
     int i, j;
     for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
         for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -247,9 +314,7 @@ matrix matrix_invert(matrix m)
             return none;
         }
 
-        double *swap = c.data[index];
-        c.data[index] = c.data[k];
-        c.data[k] = swap;
+        swap_rows(c, index, k);
 
         double val = c.data[k][k];
         c.data[k][k] = 1;
@@ -314,9 +379,7 @@ int* in_place_LUP(matrix m)
         pivot[k] = pivot[index];
         pivot[index] = swapi;
 
-        double *swap = m.data[index];
-        m.data[index] = m.data[k];
-        m.data[k] = swap;
+        swap_rows(m, index, k);
 
         for(i = k+1; i < m.rows; ++i){
             m.data[i][k] = m.data[i][k]/m.data[k][k];
@@ -361,13 +424,13 @@ double *sle_solve(matrix A, double *b)
 matrix solve_system(matrix M, matrix b)
 {
     matrix none = {0};
-    matrix Mt = transpose_matrix(M);
-    matrix MtM = matrix_mult_matrix(Mt, M);
+    matrix MtM = transpose_mult_matrix(M, M);
     matrix MtMinv = matrix_invert(MtM);
+    free_matrix(MtM);
     if(!MtMinv.data) return none;
-    matrix Mdag = matrix_mult_matrix(MtMinv, Mt);
+    matrix Mdag = matrix_mult_transpose(MtMinv, M);
     matrix a = matrix_mult_matrix(Mdag, b);
-    free_matrix(Mt); free_matrix(MtM); free_matrix(MtMinv); free_matrix(Mdag);
+    free_matrix(MtMinv); free_matrix(Mdag);
     return a;
 }
 
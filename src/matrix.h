@@ -1,11 +1,23 @@
 #ifndef MATRIX_H
 #define MATRIX_H
+// Matrices are stored row-major in one buffer, vals, with row i starting at
+// vals + i*stride. data[i] points at row i so m.data[i][j] indexing works.
+// A shallow matrix (a view) doesn't own its values.
 typedef struct matrix{
     int rows, cols;
     double **data;
     int shallow;
+    double *vals;
+    int stride;
 } matrix;
 
+// Row-major floats, half the size of a matrix, for storing large data like
+// datasets. Widen rows into a matrix to compute with them.
+typedef struct{
+    int rows, cols;
+    float *vals;
+} float_matrix;
+
 typedef struct LUP{
     matrix *L;
     matrix *U;
@@ -19,9 +31,20 @@ matrix make_translation_homography(float dx, float dy);
 void free_matrix(matrix m);
 double mag_matrix(matrix m);
 matrix make_matrix(int rows, int cols);
+matrix matrix_view(matrix m, int row, int col, int rows, int cols);
 matrix copy_matrix(matrix m);
+float_matrix make_float_matrix(int rows, int cols);
+void free_float_matrix(float_matrix m);
+matrix float_matrix_rows(float_matrix m, int row, int rows);
 double *sle_solve(matrix A, double *b);
+typedef enum{PRECISION_DOUBLE, PRECISION_FLOAT} PRECISION;
+matrix matrix_product(matrix a, int ta, matrix b, int tb, PRECISION p);
 matrix matrix_mult_matrix(matrix a, matrix b);
+matrix transpose_mult_matrix(matrix a, matrix b);
+matrix matrix_mult_transpose(matrix a, matrix b);
+void gemm(int ta, int tb, int M, int N, int K,
+        const double *A, int lda, const double *B, int ldb, double *C, int ldc, PRECISION p);
+void bench_gemm(int m, int k, int n, int iters);
 matrix matrix_elmult_matrix(matrix a, matrix b);
 void print_matrix(matrix m);
 double **n_principal_components(matrix m, int n);
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "image.h"
+
+// Image kernels split their rows into contiguous bands, one per thread,
+// with OpenMP static scheduling. Each output pixel is written by exactly
+// one thread and no kernel reduces across threads, so results do not depend
+// on the thread count. Without OpenMP (the default build) everything runs
+// on the calling thread.
+
+static int num_threads = 0;
+
+// Number of threads image kernels will use. Defaults to the UWIMG_THREADS
+// environment variable if set, otherwise to the OpenMP default (which
+// honors OMP_NUM_THREADS).
+int get_num_threads()
+{
+    if (!num_threads) {
+        char *env = getenv("UWIMG_THREADS");
+        int n = env ? atoi(env) : 0;
+#ifdef _OPENMP
+        if (n < 1) n = omp_get_max_threads();
+#endif
+        num_threads = n < 1 ? 1 : n;
+    }
+    return num_threads;
+}
+
+// Set the number of threads image kernels use.
+// int n: thread count, values below 1 mean 1.
+void set_num_threads(int n)
+{
+    num_threads = n < 1 ? 1 : n;
+}
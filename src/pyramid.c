@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+// Gaussian pyramids use the 5-tap binomial kernel [1 4 6 4 1]/16 (Burt &
+// Adelson). pyr_down only evaluates the kernel at the even samples it
+// keeps, so blur and decimation happen in one pass. Borders are clamped
+// like get_pixel.
+
+static int clamp_coord(int x, int n)
+{
+    return x < 0 ? 0 : (x >= n ? n - 1 : x);
+}
+
+// Blur and decimate src by 2 into dst, which must be ((w+1)/2, (h+1)/2).
+// Rows are first reduced horizontally into a half-width scratch image,
+// then five of those rows are combined for each output row.
+void pyr_down_into(image src, image dst)
+{
+    int w = dst.w;
+    image tmp = make_image(w, src.h, src.c);
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < src.h * src.c; r++) {
+        const float *s = src.data + r * src.w;
+        float *t = tmp.data + r * w;
+        for (int x = 0; x < w; x++) {
+            int x0 = 2 * x;
+            if (x0 >= 2 && x0 + 2 < src.w) {
+                t[x] = (s[x0 - 2] + s[x0 + 2] + 4 * (s[x0 - 1] + s[x0 + 1]) +
+                        6 * s[x0]) * (1.f / 16);
+            } else {
+                t[x] = (s[clamp_coord(x0 - 2, src.w)] +
+                        s[clamp_coord(x0 + 2, src.w)] +
+                        4 * (s[clamp_coord(x0 - 1, src.w)] +
+                             s[clamp_coord(x0 + 1, src.w)]) +
+                        6 * s[x0]) * (1.f / 16);
+            }
+        }
+    }
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < dst.h * dst.c; r++) {
+        int k = r / dst.h;
+        int y0 = 2 * (r % dst.h);
+        const float *plane = tmp.data + k * w * src.h;
+        const float *a = plane + clamp_coord(y0 - 2, src.h) * w;
+        const float *b = plane + clamp_coord(y0 - 1, src.h) * w;
+        const float *c = plane + y0 * w;
+        const float *d = plane + clamp_coord(y0 + 1, src.h) * w;
+        const float *e = plane + clamp_coord(y0 + 2, src.h) * w;
+        float *out = dst.data + r * w;
+        for (int x = 0; x < w; x++) {
+            out[x] = (a[x] + e[x] + 4 * (b[x] + d[x]) + 6 * c[x]) * (1.f / 16);
+        }
+    }
+
+    free_image(tmp);
+}
+
+// Blur and decimate an image by 2.
+// image im: image to reduce.
+// returns: image of size ((w+1)/2, (h+1)/2).
+image pyr_down(image im)
+{
+    image dst = make_image((im.w + 1) / 2, (im.h + 1) / 2, im.c);
+    pyr_down_into(im, dst);
+    return dst;
+}
+
+// Upsample by 2 with the same kernel, interpolating the missing samples.
+// Even outputs weigh their neighbours [1 6 1]/8, odd ones [4 4]/8.
+// image im: image to expand.
+// int w, h: output size, normally the size of the finer pyramid level.
+// returns: expanded image.
+image pyr_up(image im, int w, int h)
+{
+    image tmp = make_image(w, im.h, im.c);
+    image out = make_image(w, h, im.c);
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < im.h * im.c; r++) {
+        const float *s = im.data + r * im.w;
+        float *t = tmp.data + r * w;
+        for (int x = 0; x < w; x++) {
+            int i = x / 2;
+            if (x % 2 == 0) {
+                t[x] = (s[clamp_coord(i - 1, im.w)] + 6 * s[clamp_coord(i, im.w)] +
+                        s[clamp_coord(i + 1, im.w)]) * (1.f / 8);
+            } else {
+                t[x] = (s[clamp_coord(i, im.w)] + s[clamp_coord(i + 1, im.w)]) * .5f;
+            }
+        }
+    }
+
+#pragma omp parallel for schedule(static) num_threads(get_num_threads())
+    for (int r = 0; r < h * im.c; r++) {
+        int k = r / h;
+        int y = r % h;
+        int i = y / 2;
+        const float *plane = tmp.data + k * w * im.h;
+        const float *a = plane + clamp_coord(i - 1, im.h) * w;
+        const float *b = plane + clamp_coord(i, im.h) * w;
+        const float *c = plane + clamp_coord(i + 1, im.h) * w;
+        float *o = out.data + r * w;
+        if (y % 2 == 0) {
+            for (int x = 0; x < w; x++) o[x] = (a[x] + 6 * b[x] + c[x]) * (1.f / 8);
+        } else {
+            for (int x = 0; x < w; x++) o[x] = (b[x] + c[x]) * .5f;
+        }
+    }
+
+    free_image(tmp);
+    return out;
+}
+
+// Make a Gaussian pyramid over an image. Only level 0 (a copy of im) is
+// filled in; coarser levels are built the first time they are requested.
+// image im: finest level.
+// int levels: number of levels, capped so the coarsest is at least 1x1.
+// returns: pyramid, release with free_pyramid.
+pyramid make_pyramid(image im, int levels)
+{
+    pyramid p;
+    int w = im.w, h = im.h;
+    p.n = 1;
+    while (p.n < levels && (w > 1 || h > 1)) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        p.n++;
+    }
+    p.levels = calloc(p.n, sizeof(image));
+    p.levels[0] = copy_image(im);
+    p.built = 1;
+    return p;
+}
+
+// Get a pyramid level, building it (and any levels above it) if needed.
+// Buffers from a previous frame are reused when their size still matches.
+image get_pyramid_level(pyramid *p, int level)
+{
+    if (level >= p->n) level = p->n - 1;
+    for (; p->built <= level; p->built++) {
+        image src = p->levels[p->built - 1];
+        image *dst = &p->levels[p->built];
+        int w = (src.w + 1) / 2, h = (src.h + 1) / 2;
+        if (!dst->data || dst->w != w || dst->h != h || dst->c != src.c) {
+            free_image(*dst);
+            *dst = make_image(w, h, src.c);
+        }
+        pyr_down_into(src, *dst);
+    }
+    return p->levels[level];
+}
+
+// Point a pyramid at a new frame, e.g. the next video frame. Level 0 is
+// overwritten in place when the size matches and coarser levels are
+// rebuilt lazily into their existing buffers.
+void update_pyramid(pyramid *p, image im)
+{
+    image *base = &p->levels[0];
+    if (base->w == im.w && base->h == im.h && base->c == im.c) {
+        memcpy(base->data, im.data, im.w * im.h * im.c * sizeof(float));
+    } else {
+        free_image(*base);
+        *base = copy_image(im);
+    }
+    p->built = 1;
+}
+
+void free_pyramid(pyramid p)
+{
+    for (int i = 0; i < p.n; i++) {
+        if (p.levels[i].data) free_image(p.levels[i]);
+    }
+    free(p.levels);
+}
+
+// Make a Laplacian pyramid: each level is a Gaussian level minus the
+// expanded next one, and the last level is the coarsest Gaussian level.
+pyramid make_laplacian_pyramid(image im, int levels)
+{
+    pyramid g = make_pyramid(im, levels);
+    get_pyramid_level(&g, g.n - 1);
+
+    pyramid l = g;
+    l.levels = calloc(g.n, sizeof(image));
+    for (int i = 0; i < g.n - 1; i++) {
+        image up = pyr_up(g.levels[i + 1], g.levels[i].w, g.levels[i].h);
+        l.levels[i] = sub_image(g.levels[i], up);
+        free_image(up);
+    }
+    l.levels[g.n - 1] = copy_image(g.levels[g.n - 1]);
+    free_pyramid(g);
+    return l;
+}
+
+// Rebuild the image a Laplacian pyramid was made from.
+image collapse_laplacian_pyramid(pyramid p)
+{
+    image r = copy_image(p.levels[p.n - 1]);
+    for (int i = p.n - 2; i >= 0; i--) {
+        image up = pyr_up(r, p.levels[i].w, p.levels[i].h);
+        free_image(r);
+        r = add_image(p.levels[i], up);
+        free_image(up);
+    }
+    return r;
+}
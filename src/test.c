@@ -2,6 +2,10 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
@@ -82,9 +86,11 @@ int same_image(image a, image b, float eps)
         int x = i % a.w;
         int y = (i / a.w) % a.h;
         int z = (i / (a.w * a.h));
+        // Relative tolerance for large values, computed per pixel so one
+        // bright pixel doesn't loosen the check for the rest of the image.
         float thresh = (fabs(b.data[i]) + fabs(a.data[i])) * eps / 2;
-        if (thresh > eps) eps = thresh;
-        if(!within_eps(a.data[i], b.data[i], eps)) 
+        if (thresh < eps) thresh = eps;
+        if(!within_eps(a.data[i], b.data[i], thresh)) 
         {
             printf("    Index %d, Pixel (%d, %d, %d) should be %f, but it is %f! \n", i, x, y, z, b.data[i], a.data[i]);
             return 0;
@@ -256,6 +262,15 @@ void test_shift()
     TEST(within_eps(c.data[im.w*im.h + 13], im.data[im.w*im.h+13] + .1, EPS));
     TEST(within_eps(c.data[2*im.w*im.h + 72], im.data[2*im.w*im.h+72], EPS));
     TEST(within_eps(c.data[im.w*im.h + 47], im.data[im.w*im.h+47] + .1, EPS));
+
+    // Channels that don't exist are ignored, like set_pixel does.
+    image d = copy_image(c);
+    shift_image(d, 3, .1);
+    shift_image(d, -1, .1);
+    scale_image(d, 3, 2);
+    scale_image(d, -1, 2);
+    TEST(0 == memcmp(c.data, d.data, c.w*c.h*c.c*sizeof(float)));
+    free_image(d);
     free_image(im);
     free_image(c);
 }
@@ -281,6 +296,172 @@ void test_hsv_to_rgb()
     free_image(c);
 }
 
+void test_hsv_fast()
+{
+    image im = load_image("data/dog.jpg");
+    image hsv = copy_image(im);
+    image fast = copy_image(im);
+    rgb_to_hsv(hsv);
+    rgb_to_hsv_fast(fast);
+    TEST(same_image(fast, hsv, EPS));
+
+    hsv_to_rgb_fast(fast);
+    hsv_to_rgb(hsv);
+    TEST(same_image(fast, hsv, EPS));
+    TEST(same_image(fast, im, EPS));
+    free_image(im);
+    free_image(hsv);
+    free_image(fast);
+}
+
+void test_image_pool()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image_pool *p = make_image_pool();
+    image_pool *prev = use_image_pool(p);
+
+    image a = make_image(100, 50, 3);
+    TEST((size_t)a.data % 64 == 0);
+    float *data = a.data;
+    a.data[17] = 1;
+    free_image(a);
+    image b = make_image(50, 100, 3);
+    TEST(b.data == data);
+    TEST(b.data[17] == 0);
+
+    // A frame's worth of work shouldn't need new buffers once warmed up.
+    int i, blocks = 0;
+    for(i = 0; i < 3; ++i){
+        image s = structure_matrix(im, 2);
+        image r = cornerness_response(s);
+        free_image(s);
+        free_image(r);
+        reset_image_pool(p);
+        if (i == 1) blocks = image_pool_blocks(p);
+    }
+    TEST(blocks == image_pool_blocks(p));
+
+    use_image_pool(prev);
+    free_image_pool(p);
+    free_image(im);
+}
+
+void test_byte_conversion()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int stride = im.w*3 + 5;
+    unsigned char *bytes = calloc(stride*im.h, 1);
+    image_to_bytes(im, bytes, stride, 1);
+    TEST(bytes[0] == (unsigned char)roundf(255*get_pixel(im, 0, 0, 2)));
+    TEST(bytes[stride + 3*7 + 2] == (unsigned char)roundf(255*get_pixel(im, 7, 1, 0)));
+
+    image back = make_image(im.w, im.h, 3);
+    bytes_to_image(bytes, stride, 1, back);
+    TEST(same_image(back, im, EPS));
+
+    // Out of range values saturate rather than wrapping around.
+    image hot = make_image(2, 1, 1);
+    hot.data[0] = -.3;
+    hot.data[1] = 1.7;
+    image_to_bytes(hot, bytes, 2, 0);
+    TEST(bytes[0] == 0 && bytes[1] == 255);
+
+    // Every byte value, across the 16 pixel SIMD blocks and the scalar tail.
+    int i, n = 259, exact = 1;
+    unsigned char *all = calloc(3*n, 1);
+    unsigned char *again = calloc(3*n, 1);
+    for(i = 0; i < 3*n; ++i) all[i] = (i*7) % 256;
+    image row = make_image(n, 1, 3);
+    bytes_to_image(all, 3*n, 0, row);
+    for(i = 0; i < 3*n; ++i) exact &= row.data[(i%3)*n + i/3] == all[i]*(1.f/255);
+    TEST(exact);
+    image_to_bytes(row, again, 3*n, 0);
+    TEST(0 == memcmp(all, again, 3*n));
+
+    free(all);
+    free(again);
+    free(bytes);
+    free_image(im);
+    free_image(back);
+    free_image(hot);
+    free_image(row);
+}
+
+void test_binary_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    save_image_binary(im, "data/test_image.bin");
+    image loaded = load_image_binary("data/test_image.bin");
+    TEST(same_image(loaded, im, 0.0001));
+    image mapped = map_image_binary("data/test_image.bin");
+    TEST((size_t)mapped.data % 64 == 0);
+    TEST(same_image(mapped, im, 0.0001));
+    // Writes to a mapped image stay private to it.
+    mapped.data[0] = 2;
+    free_image(mapped);
+    image again = load_image_binary("data/test_image.bin");
+    TEST(same_image(again, im, 0.0001));
+
+    FILE *fp = fopen("data/test_image.bin", "r+b");
+    fseek(fp, 64 + 4*100, SEEK_SET);
+    fputc(0x7f, fp);
+    fclose(fp);
+    image bad = load_image_binary("data/test_image.bin");
+    TEST(bad.data == 0);
+
+    // A file from a machine of the other byte order: every header field and
+    // data word reversed, the checksum still over the same values.
+    save_image_binary(im, "data/test_image.bin");
+    fp = fopen("data/test_image.bin", "rb");
+    size_t n = 64 + 4*(size_t)im.w*im.h*im.c, i;
+    unsigned char *bytes = malloc(n);
+    TEST(fread(bytes, 1, n, fp) == n);
+    fclose(fp);
+    int fields[][2] = {{4, 2}, {6, 2}, {8, 4}, {12, 4}, {16, 4}, {20, 4}, {24, 8}, {32, 8}, {40, 8}};
+    for(i = 0; i < 9 + (n - 64)/4; ++i){
+        int at = i < 9 ? fields[i][0] : 64 + 4*(i - 9);
+        int len = i < 9 ? fields[i][1] : 4, j;
+        for(j = 0; j < len/2; ++j){
+            unsigned char t = bytes[at + j];
+            bytes[at + j] = bytes[at + len - 1 - j];
+            bytes[at + len - 1 - j] = t;
+        }
+    }
+    fp = fopen("data/test_image.bin", "wb");
+    fwrite(bytes, 1, n, fp);
+    fclose(fp);
+    image swapped = load_image_binary("data/test_image.bin");
+    TEST(same_image(swapped, im, 0.0001));
+    image swapped_mapped = map_image_binary("data/test_image.bin");
+    TEST(same_image(swapped_mapped, im, 0.0001));
+
+    // Files that claim more data than they hold are rejected before any
+    // allocation: a cut off image, and a file that isn't a binary image.
+    fp = fopen("data/test_image.bin", "wb");
+    fwrite(bytes, 1, n/2, fp);
+    fclose(fp);
+    image cut = load_image_binary("data/test_image.bin");
+    TEST(cut.data == 0);
+    image foreign = load_image_binary("data/dogsmall.jpg");
+    TEST(foreign.data == 0);
+    free(bytes);
+    free_image(swapped);
+    free_image(swapped_mapped);
+    remove("data/test_image.bin");
+
+    // Files written before the header existed still load.
+    image legacy = load_image_binary("data/velocity.bin");
+    image legacy_mapped = map_image_binary("data/velocity.bin");
+    TEST(legacy.w == 64 && legacy.h == 36 && legacy.c == 3);
+    TEST(same_image(legacy, legacy_mapped, 0.0001));
+
+    free_image(im);
+    free_image(loaded);
+    free_image(again);
+    free_image(legacy);
+    free_image(legacy_mapped);
+}
+
 void test_nn_interpolate()
 {
     image im = load_image("data/dogsmall.jpg");
@@ -341,6 +522,73 @@ void test_bl_resize()
     free_image(gt2);
 }
 
+void test_area_resize()
+{
+    image im = load_image("data/dog.jpg");
+    image small = area_resize(im, im.w/4, im.h/4);
+    image gt = make_image(im.w/4, im.h/4, im.c);
+    int i, j, k, dx, dy;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < gt.h; ++j){
+            for(i = 0; i < gt.w; ++i){
+                float sum = 0;
+                for(dy = 0; dy < 4; ++dy){
+                    for(dx = 0; dx < 4; ++dx){
+                        sum += get_pixel(im, 4*i + dx, 4*j + dy, k);
+                    }
+                }
+                set_pixel(gt, i, j, k, sum/16);
+            }
+        }
+    }
+    TEST(same_image(small, gt, EPS));
+
+    image flat = make_image(101, 67, 1);
+    for(i = 0; i < flat.w*flat.h; ++i) flat.data[i] = .5;
+    image sflat = area_resize(flat, 13, 9);
+    image gflat = make_image(13, 9, 1);
+    for(i = 0; i < gflat.w*gflat.h; ++i) gflat.data[i] = .5;
+    TEST(same_image(sflat, gflat, EPS));
+    free_image(im);
+    free_image(small);
+    free_image(gt);
+    free_image(flat);
+    free_image(sflat);
+    free_image(gflat);
+}
+void test_resample()
+{
+    image im = load_image("data/dog.jpg");
+    image same = resample_image(im, im.w, im.h, RESAMPLE_LANCZOS3);
+    TEST(same_image(same, im, EPS));
+    free_image(same);
+    same = resample_image(im, im.w, im.h, RESAMPLE_BICUBIC);
+    TEST(same_image(same, im, EPS));
+    free_image(same);
+
+    image area = area_resize(im, 97, 61);
+    image rarea = resample_image(im, 97, 61, RESAMPLE_AREA);
+    TEST(same_image(rarea, area, EPS));
+
+    // A one pixel checkerboard should average out to gray, not alias.
+    image check = make_image(128, 96, 1);
+    int i, j;
+    for(j = 0; j < check.h; ++j){
+        for(i = 0; i < check.w; ++i){
+            set_pixel(check, i, j, 0, (i + j) % 2);
+        }
+    }
+    image small = resample_image(check, 29, 21, RESAMPLE_LANCZOS3);
+    image gray = make_image(29, 21, 1);
+    for(i = 0; i < gray.w*gray.h; ++i) gray.data[i] = .5;
+    TEST(same_image(small, gray, .02));
+    free_image(im);
+    free_image(area);
+    free_image(rarea);
+    free_image(check);
+    free_image(small);
+    free_image(gray);
+}
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -432,6 +680,134 @@ void test_gaussian_filter(){
     free_image(gt);
 }
 
+// Straightforward per-pixel convolution, taps in x-outer, y-inner order.
+image reference_convolve(image im, image f, int preserve)
+{
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    int x, y, k, i, j;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            float total = 0;
+            for(k = 0; k < im.c; ++k){
+                float sum = 0;
+                for(i = -f.w/2; i <= f.w/2; ++i){
+                    for(j = -f.h/2; j <= f.h/2; ++j){
+                        sum += get_pixel(im, x+i, y+j, k) * get_pixel(f, f.w/2+i, f.h/2+j, f.c == 1 ? 0 : k);
+                    }
+                }
+                if(preserve) set_pixel(out, x, y, k, sum);
+                else total += sum;
+            }
+            if(!preserve) set_pixel(out, x, y, 0, total);
+        }
+    }
+    return out;
+}
+
+void test_direct_convolution(){
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_image(5, 4, 3);
+    int i, preserve;
+    for(i = 0; i < f.w*f.h*f.c; ++i) f.data[i] = (i%7 - 3)/5.;
+    for(preserve = 0; preserve < 2; ++preserve){
+        image direct = convolve_image_method(im, f, preserve, CONV_DIRECT);
+        image ref = reference_convolve(im, f, preserve);
+        TEST(0 == memcmp(direct.data, ref.data, ref.w*ref.h*ref.c*sizeof(float)));
+        free_image(direct);
+        free_image(ref);
+    }
+    free_image(im);
+    free_image(f);
+}
+
+#ifdef _OPENMP
+// Run a kernel from each threaded module at the current thread count.
+static void run_threaded_kernels(image im, image f, image out[6])
+{
+    int method;
+    for(method = CONV_DIRECT; method <= CONV_FFT; ++method){
+        out[method - CONV_DIRECT] = convolve_image_method(im, f, 1, method);
+    }
+    out[3] = copy_image(im);
+    rgb_to_hsv(out[3]);
+    out[4] = bilinear_resize(im, im.w*3/2, im.h*3/2);
+    out[5] = structure_matrix(im, 2);
+}
+#endif
+
+void test_thread_determinism(){
+#ifndef _OPENMP
+    fprintf(stderr, "skipped: [%s] built without OpenMP, rebuild with OPENMP=1\n", __FUNCTION__);
+#else
+    int threads = get_num_threads();
+    set_num_threads(4);
+    int team = 0;
+#pragma omp parallel num_threads(get_num_threads())
+    {
+#pragma omp single
+        team = omp_get_num_threads();
+    }
+    TEST(team == 4);
+
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image serial[6], parallel[6];
+    set_num_threads(1);
+    run_threaded_kernels(im, f, serial);
+    set_num_threads(4);
+    run_threaded_kernels(im, f, parallel);
+    int i, same = 1;
+    for(i = 0; i < 6; ++i){
+        same &= 0 == memcmp(serial[i].data, parallel[i].data, serial[i].w*serial[i].h*serial[i].c*sizeof(float));
+        free_image(serial[i]);
+        free_image(parallel[i]);
+    }
+    TEST(same);
+
+    matrix a = random_matrix(200, 300, 1);
+    matrix b = random_matrix(300, 100, 1);
+    set_num_threads(1);
+    matrix ms = matrix_mult_matrix(a, b);
+    set_num_threads(4);
+    matrix mp = matrix_mult_matrix(a, b);
+    TEST(0 == memcmp(ms.vals, mp.vals, ms.rows*ms.cols*sizeof(double)));
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(ms);
+    free_matrix(mp);
+
+    set_num_threads(threads);
+    free_image(im);
+    free_image(f);
+#endif
+}
+
+void test_convolution_methods(){
+    image im = load_image("data/dog.jpg");
+    image gauss = make_gaussian_filter(3);
+    image emboss = make_emboss_filter();
+    int preserve;
+    for(preserve = 0; preserve < 2; ++preserve){
+        image direct = convolve_image_method(im, gauss, preserve, CONV_DIRECT);
+        image sep = convolve_image_method(im, gauss, preserve, CONV_SEPARABLE);
+        image fft = convolve_image_method(im, gauss, preserve, CONV_FFT);
+        TEST(same_image(sep, direct, EPS));
+        TEST(same_image(fft, direct, EPS));
+        free_image(direct);
+        free_image(sep);
+        free_image(fft);
+
+        direct = convolve_image_method(im, emboss, preserve, CONV_DIRECT);
+        fft = convolve_image_method(im, emboss, preserve, CONV_FFT);
+        TEST(same_image(fft, direct, EPS));
+        free_image(direct);
+        free_image(fft);
+    }
+    free_image(im);
+    free_image(gauss);
+    free_image(emboss);
+}
+
 void test_gaussian_blur(){
     image im = load_image("data/dog.jpg");
     image f = make_gaussian_filter(2);
@@ -446,6 +822,53 @@ void test_gaussian_blur(){
     free_image(gt);
 }
 
+void test_pyramid(){
+    image im = load_image("data/dog.jpg");
+    pyramid p = make_pyramid(im, 4);
+    TEST(p.n == 4 && p.built == 1);
+    image top = get_pyramid_level(&p, 3);
+    TEST(p.built == 4);
+    TEST(top.w == 96 && top.h == 72 && top.c == 3);
+
+    // A level is the binomial blur of the one below, sampled at even pixels.
+    image f = make_image(5, 5, 1);
+    float b[] = {1, 4, 6, 4, 1};
+    int i, j, k;
+    for(j = 0; j < 5; ++j){
+        for(i = 0; i < 5; ++i){
+            set_pixel(f, i, j, 0, b[i]*b[j]/256);
+        }
+    }
+    image blur = convolve_image(im, f, 1);
+    image half = make_image((im.w+1)/2, (im.h+1)/2, im.c);
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < half.h; ++j){
+            for(i = 0; i < half.w; ++i){
+                set_pixel(half, i, j, k, get_pixel(blur, 2*i, 2*j, k));
+            }
+        }
+    }
+    image level = get_pyramid_level(&p, 1);
+    TEST(same_image(level, half, EPS));
+
+    // Updating with a same-sized frame reuses the level buffers.
+    update_pyramid(&p, im);
+    TEST(p.built == 1);
+    TEST(get_pyramid_level(&p, 1).data == level.data);
+
+    pyramid l = make_laplacian_pyramid(im, 5);
+    image back = collapse_laplacian_pyramid(l);
+    TEST(same_image(back, im, EPS));
+
+    free_image(im);
+    free_image(f);
+    free_image(blur);
+    free_image(half);
+    free_image(back);
+    free_pyramid(p);
+    free_pyramid(l);
+}
+
 void test_hybrid_image(){
     image melisa = load_image("data/melisa.png");
     image aria = load_image("data/aria.png");
@@ -529,6 +952,63 @@ void test_sobel(){
     free(res);
 }
 
+void test_sobel_fused(){
+    image im = load_image("data/dog.jpg");
+    image fx = make_gx_filter();
+    image fy = make_gy_filter();
+    image gx = convolve_image(im, fx, 0);
+    image gy = convolve_image(im, fy, 0);
+    image *res = sobel_image(im);
+    image *fast = sobel_image_fast(im);
+    // Reference magnitude and orientation from the two separate
+    // convolutions, so the fused gradients are checked independently.
+    image mag = make_image(im.w, im.h, 1);
+    image theta = make_image(im.w, im.h, 1);
+    int i;
+    for(i = 0; i < im.w*im.h; ++i){
+        mag.data[i] = sqrtf(gx.data[i]*gx.data[i] + gy.data[i]*gy.data[i]);
+        theta.data[i] = atan2f(gy.data[i], gx.data[i]);
+    }
+    TEST(same_image(res[0], mag, EPS));
+    TEST(same_image(fast[0], mag, EPS));
+
+    // Orientation is only compared where the gradient is large enough for
+    // the angle to be well defined.
+    float err = 0, fast_err = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        if(mag.data[i] < .01) continue;
+        float d = fabsf(res[1].data[i] - theta.data[i]);
+        float fd = fabsf(fast[1].data[i] - theta.data[i]);
+        if(d > M_PI) d = 2*M_PI - d;
+        if(fd > M_PI) fd = 2*M_PI - fd;
+        if(d > err) err = d;
+        if(fd > fast_err) fast_err = fd;
+    }
+    TEST(err < EPS);
+    TEST(fast_err < EPS);
+
+    // The fast atan2 stays close to the exact one everywhere.
+    err = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        float d = fabsf(fast[1].data[i] - res[1].data[i]);
+        if(d > err) err = d;
+    }
+    TEST(err < 1e-4);
+    free_image(im);
+    free_image(fx);
+    free_image(fy);
+    free_image(gx);
+    free_image(gy);
+    free_image(mag);
+    free_image(theta);
+    free_image(res[0]);
+    free_image(res[1]);
+    free_image(fast[0]);
+    free_image(fast[1]);
+    free(res);
+    free(fast);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -541,6 +1021,31 @@ void test_structure()
     free_image(gt);
 }
 
+void test_smooth_recursive()
+{
+    image im = load_image("data/dogbw.png");
+    image conv = smooth_image_convolve(im, 4);
+    set_smooth_mode(SMOOTH_RECURSIVE);
+    image rec = smooth_image(im, 4);
+    set_smooth_mode(SMOOTH_CONVOLVE);
+    float err = 0;
+    int i;
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        float d = fabsf(rec.data[i] - conv.data[i]);
+        if(d > err) err = d;
+    }
+    TEST(err < .03);
+
+    image flat = make_image(37, 23, 2);
+    for(i = 0; i < flat.w*flat.h*flat.c; ++i) flat.data[i] = .25;
+    image sflat = smooth_image_recursive(flat, 6);
+    TEST(same_image(sflat, flat, EPS));
+    free_image(im);
+    free_image(conv);
+    free_image(rec);
+    free_image(flat);
+    free_image(sflat);
+}
 void test_cornerness()
 {
     image im = load_image("data/dogbw.png");
@@ -813,6 +1318,10 @@ void test_hw0()
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_hsv_fast();
+    test_image_pool();
+    test_byte_conversion();
+    test_binary_image();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -822,6 +1331,8 @@ void test_hw1()
     test_bl_interpolate();
     test_bl_resize();
     test_multiple_resize();
+    test_area_resize();
+    test_resample();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw2()
@@ -831,15 +1342,21 @@ void test_hw2()
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
+    test_direct_convolution();
+    test_convolution_methods();
+    test_thread_determinism();
     test_gaussian_blur();
+    test_pyramid();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_sobel_fused();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw3()
 {
     test_structure();
+    test_smooth_recursive();
     test_cornerness();
     test_projection();
     test_compute_homography();
@@ -896,7 +1413,10 @@ void test_exact_box_filter_image()
     image smooth_t = load_image("data/dogbox.png");
     //printf("avg origin difference test: %f\n", avg_diff(smooth, dog));
     //printf("avg smooth difference test: %f\n", avg_diff(smooth, smooth_t));
-    TEST(same_image(smooth, smooth_t, EPS*2));
+    // dogbox.png was made from a float summed-area table that drifts by up
+    // to ~.004 on top of 8-bit quantization; test_box_filter_exact checks
+    // the filter against a brute force mean instead.
+    TEST(same_image(smooth, smooth_t, EPS*3));
 
     free_image(dog);
     free_image(smooth);
@@ -912,7 +1432,7 @@ void test_good_enough_box_filter_image()
     image dog_c = center_crop(dog);
     printf("avg origin difference test: %f\n", avg_diff(smooth_c, dog_c));
     printf("avg smooth difference test: %f\n", avg_diff(smooth_c, smooth_t));
-    TEST(same_image(smooth_c, smooth_t, EPS*2));
+    TEST(same_image(smooth_c, smooth_t, EPS*3));
 
     free_image(dog);
     free_image(dog_c);
@@ -920,6 +1440,48 @@ void test_good_enough_box_filter_image()
     free_image(smooth_t);
     free_image(smooth_c);
 }
+void test_box_filter_exact()
+{
+    image dog = load_image("data/dog.jpg");
+    int sizes[] = {1, 4, 15, 61};
+    int n, i, j, k, x, y;
+    for(n = 0; n < 4; ++n){
+        int s = sizes[n];
+        image smooth = box_filter_image(dog, s);
+        image gt = make_image(dog.w, dog.h, dog.c);
+        for(k = 0; k < dog.c; ++k){
+            for(j = 0; j < dog.h; j += 7){
+                for(i = 0; i < dog.w; i += 5){
+                    double sum = 0;
+                    int count = 0;
+                    for(y = MAX(j - s/2, 0); y <= MIN(j + s/2, dog.h - 1); ++y){
+                        for(x = MAX(i - s/2, 0); x <= MIN(i + s/2, dog.w - 1); ++x){
+                            sum += get_pixel(dog, x, y, k);
+                            ++count;
+                        }
+                    }
+                    set_pixel(gt, i, j, k, sum/count);
+                }
+            }
+        }
+        for(i = 0; i < dog.w*dog.h*dog.c; ++i){
+            int xi = i % dog.w, yi = (i / dog.w) % dog.h;
+            if(xi % 5 || yi % 7) gt.data[i] = smooth.data[i];
+        }
+        TEST(same_image(smooth, gt, 1e-5));
+        free_image(smooth);
+        free_image(gt);
+    }
+
+    // Summing a large constant image in float drifts; the table must not.
+    image flat = make_image(2000, 1500, 1);
+    for(i = 0; i < flat.w*flat.h; ++i) flat.data[i] = .1;
+    image integ = make_integral_image(flat);
+    TEST(within_eps(integ.data[flat.w*flat.h-1], .1*2000*1500, .1));
+    free_image(flat);
+    free_image(integ);
+    free_image(dog);
+}
 void test_structure_image()
 {
     image doga = load_image("data/dog_a_small.jpg");
@@ -947,20 +1509,450 @@ void test_velocity_image()
     free_image(velocity);
     free_image(velocity_t);
 }
+void test_velocity_conditioning()
+{
+    // The flag is expected wherever the smallest eigenvalue of M is not
+    // above the threshold. Unflagged pixels match the inverse from
+    // matrix_invert, flagged ones get zero velocity.
+    float t = .5;
+    set_flow_min_eigenvalue(t);
+    image structure = load_image_binary("data/structure.bin");
+    image v = velocity_image(structure, 1);
+    image gt = make_image(structure.w, structure.h, 3);
+    int i, j, flagged = 0;
+    int n = structure.w*structure.h;
+    matrix M = make_matrix(2, 2);
+    for(j = 0; j < structure.h; ++j){
+        for(i = 0; i < structure.w; ++i){
+            int p = i + j*structure.w;
+            double a = structure.data[p];
+            double d = structure.data[p + n];
+            double b = structure.data[p + 2*n];
+            double lmin = .5*(a + d - sqrt((a - d)*(a - d) + 4*b*b));
+            if(lmin > t){
+                M.data[0][0] = a;
+                M.data[1][1] = d;
+                M.data[0][1] = M.data[1][0] = b;
+                matrix inv = matrix_invert(M);
+                gt.data[p] = -(inv.data[0][0]*structure.data[p + 3*n] + inv.data[0][1]*structure.data[p + 4*n]);
+                gt.data[p + n] = -(inv.data[1][0]*structure.data[p + 3*n] + inv.data[1][1]*structure.data[p + 4*n]);
+                free_matrix(inv);
+            } else {
+                gt.data[p + 2*n] = 1;
+                ++flagged;
+            }
+        }
+    }
+    TEST(flagged > 0 && flagged < n);
+    TEST(0 == memcmp(v.data + 2*n, gt.data + 2*n, n*sizeof(float)));
+    TEST(same_image(v, gt, EPS));
+    set_flow_min_eigenvalue(1e-6);
+
+    // Flat and edge-only neighbourhoods are flagged, a well-conditioned
+    // one is solved.
+    image S = make_image(3, 1, 5);
+    float xx[] = {0, 4, 2}, yy[] = {0, 0, 3}, xy[] = {0, 0, 1};
+    float xt[] = {1, 1, 1}, yt[] = {1, 0, 2};
+    for(i = 0; i < 3; ++i){
+        S.data[i] = xx[i];
+        S.data[i + 3] = yy[i];
+        S.data[i + 6] = xy[i];
+        S.data[i + 9] = xt[i];
+        S.data[i + 12] = yt[i];
+    }
+    image vs = velocity_image(S, 1);
+    TEST(vs.data[6] == 1 && vs.data[7] == 1);
+    TEST(vs.data[0] == 0 && vs.data[1] == 0 && vs.data[3] == 0 && vs.data[4] == 0);
+    TEST(vs.data[8] == 0);
+    TEST(within_eps(vs.data[2], -.2, EPS) && within_eps(vs.data[5], -.6, EPS));
+    free_matrix(M);
+    free_image(structure);
+    free_image(v);
+    free_image(gt);
+    free_image(S);
+    free_image(vs);
+}
+void test_pyramid_flow()
+{
+    image prev = load_image("data/dog.jpg");
+    image im = make_image(prev.w, prev.h, prev.c);
+    int i, j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                set_pixel(im, i, j, k, get_pixel(prev, i-9, j-6, k));
+            }
+        }
+    }
+    image v = optical_flow_pyramid(im, prev, 15, 4, 3);
+    image vc = center_crop(v);
+    float vx = 0, vy = 0;
+    for(i = 0; i < vc.w*vc.h; ++i){
+        vx += vc.data[i];
+        vy += vc.data[i + vc.w*vc.h];
+    }
+    vx /= vc.w*vc.h;
+    vy /= vc.w*vc.h;
+    TEST(within_eps(vx, 9, .25));
+    TEST(within_eps(vy, 6, .25));
+    free_image(prev);
+    free_image(im);
+    free_image(v);
+    free_image(vc);
+}
+typedef struct{
+    image base;
+    int n, frames;
+} shift_source;
+static int next_shifted_frame(void *ctx, image *frame)
+{
+    shift_source *s = ctx;
+    if(s->n == s->frames) return 0;
+    if(frame->w != s->base.w || frame->h != s->base.h){
+        free_image(*frame);
+        *frame = make_image(s->base.w, s->base.h, s->base.c);
+    }
+    int i, j, k;
+    for(k = 0; k < frame->c; ++k){
+        for(j = 0; j < frame->h; ++j){
+            for(i = 0; i < frame->w; ++i){
+                set_pixel(*frame, i, j, k, get_pixel(s->base, i - 8*s->n, j - 4*s->n, k));
+            }
+        }
+    }
+    s->n++;
+    return 1;
+}
+typedef struct{
+    image prev;
+    int matched;
+} flow_check;
+static int check_stream_flow(image frame, image v, void *ctx)
+{
+    flow_check *c = ctx;
+    image gt = optical_flow_images(frame, c->prev, 15, 8);
+    c->matched += same_image(v, gt, EPS);
+    free_image(gt);
+    memcpy(c->prev.data, frame.data, frame.w*frame.h*frame.c*sizeof(float));
+    return 0;
+}
+void test_flow_stream()
+{
+    image base = load_image("data/dog.jpg");
+    shift_source src = {base, 0, 4};
+    flow_check check = {make_image(base.w, base.h, base.c), 0};
+    memcpy(check.prev.data, base.data, base.w*base.h*base.c*sizeof(float));
+    set_flow_pyramid(3, 2);
+    flow_stats st = run_flow_stream(next_shifted_frame, &src, check_stream_flow, &check, 15, 8, 1);
+    set_flow_pyramid(1, 1);
+    TEST(st.frames == 3);
+    TEST(check.matched == 3);
+    free_image(base);
+    free_image(check.prev);
+}
+void test_frame_files()
+{
+    image base = load_image("data/dogsmall.jpg");
+    shift_source src = {base, 0, 3};
+    image frame = {0};
+    frame_writer *w = open_frame_writer("data/test_frames.bin");
+    while(next_shifted_frame(&src, &frame)) write_frame(w, frame);
+    close_frame_writer(w);
+
+    frame_reader *r = open_frame_reader("data/test_frames.bin");
+    image got = {0};
+    int n = 0;
+    src.n = 0;
+    while(read_frame(r, &got)){
+        next_shifted_frame(&src, &frame);
+        TEST(same_image(got, frame, EPS));
+        ++n;
+    }
+    TEST(n == 3);
+    close_frame_reader(r);
+
+    flow_stats st = optical_flow_files("data/test_frames.bin", 0, 15, 8, 1);
+    TEST(st.frames == 2);
+    remove("data/test_frames.bin");
+
+    // A frame that won't decode is skipped, and the buffer is reused.
+    w = open_frame_writer("data/test_frames");
+    src.n = 0;
+    while(next_shifted_frame(&src, &frame)) write_frame(w, frame);
+    close_frame_writer(w);
+    FILE *bad = fopen("data/test_frames/000001a.jpg", "w");
+    fprintf(bad, "not a jpeg");
+    fclose(bad);
+    r = open_frame_reader("data/test_frames");
+    n = 0;
+    src.n = 0;
+    float *buffer = 0;
+    int reused = 1;
+    while(read_frame(r, &got)){
+        next_shifted_frame(&src, &frame);
+        TEST(same_image(got, frame, EPS));
+        if(n) reused &= got.data == buffer;
+        buffer = got.data;
+        ++n;
+    }
+    TEST(n == 3 && reused);
+    close_frame_reader(r);
+    remove("data/test_frames/000000.png");
+    remove("data/test_frames/000001.png");
+    remove("data/test_frames/000001a.jpg");
+    remove("data/test_frames/000002.png");
+    rmdir("data/test_frames");
+    free_image(base);
+    free_image(frame);
+    free_image(got);
+}
 void test_hw4()
 {
     test_integral_image();
     test_exact_box_filter_image();
     test_good_enough_box_filter_image();
+    test_box_filter_exact();
     test_structure_image();
     test_velocity_image();
+    test_velocity_conditioning();
+    test_pyramid_flow();
+    test_flow_stream();
+    test_frame_files();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
+void test_matrix_layout()
+{
+    matrix m = make_matrix(4, 5);
+    int i, j, contiguous = 1;
+    for(i = 0; i < m.rows; ++i) contiguous &= m.data[i] == m.vals + i*m.stride;
+    TEST(contiguous && m.stride == 5);
+    for(i = 0; i < m.rows*m.cols; ++i) m.vals[i] = i;
+
+    matrix v = matrix_view(m, 1, 2, 2, 3);
+    TEST(v.shallow && v.stride == 5 && v.data[0][0] == 7 && v.data[1][2] == 14);
+    v.data[1][0] = -1;
+    TEST(m.data[2][2] == -1);
+    matrix c = copy_matrix(v);
+    TEST(same_matrix(c, v) && c.stride == 3 && !c.shallow);
+    matrix t = transpose_matrix(v);
+    int same = 1;
+    for(i = 0; i < v.rows; ++i) for(j = 0; j < v.cols; ++j) same &= t.data[j][i] == v.data[i][j];
+    TEST(same && t.data[1] == t.vals + t.stride);
+
+    // Pivoting keeps the rows in place.
+    matrix a = make_matrix(3, 3);
+    a.data[0][1] = 2; a.data[1][0] = 1; a.data[2][2] = 4; a.data[0][2] = 1;
+    matrix inv = matrix_invert(a);
+    matrix id = matrix_mult_matrix(a, inv);
+    same = 1;
+    for(i = 0; i < 3; ++i) for(j = 0; j < 3; ++j) same &= within_eps(id.data[i][j], i == j, EPS);
+    TEST(same && inv.data[2] == inv.vals + 2*inv.stride);
+    free_matrix(id);
+    free_matrix(inv);
+    free_matrix(a);
+    free_matrix(t);
+    free_matrix(c);
+    free_matrix(v);
+    free_matrix(m);
+}
+matrix naive_mult(matrix a, matrix b)
+{
+    matrix p = make_matrix(a.rows, b.cols);
+    int i, j, k;
+    for(i = 0; i < p.rows; ++i){
+        for(j = 0; j < p.cols; ++j){
+            for(k = 0; k < a.cols; ++k) p.data[i][j] += a.data[i][k]*b.data[k][j];
+        }
+    }
+    return p;
+}
+void test_gemm()
+{
+    // Tiny products take the plain loop, odd sizes and k past one block
+    // exercise the padded edges.
+    int shapes[][3] = {{1, 1, 1}, {5, 4, 3}, {13, 300, 11}, {128, 785, 32}, {7, 5, 1030}};
+    int s;
+    for(s = 0; s < 5; ++s){
+        matrix a = random_matrix(shapes[s][0], shapes[s][1], 1);
+        matrix b = random_matrix(shapes[s][1], shapes[s][2], 1);
+        matrix at = transpose_matrix(a);
+        matrix bt = transpose_matrix(b);
+        matrix gt = naive_mult(a, b);
+        matrix p = matrix_mult_matrix(a, b);
+        matrix tp = transpose_mult_matrix(at, b);
+        matrix pt = matrix_mult_transpose(a, bt);
+        TEST(same_matrix(gt, p));
+        TEST(same_matrix(gt, tp));
+        TEST(same_matrix(gt, pt));
+        free_matrix(a); free_matrix(b); free_matrix(at); free_matrix(bt);
+        free_matrix(gt); free_matrix(p); free_matrix(tp); free_matrix(pt);
+    }
+
+    // Views multiply through their stride.
+    matrix m = random_matrix(20, 30, 1);
+    matrix a = matrix_view(m, 2, 3, 9, 10);
+    matrix b = matrix_view(m, 5, 1, 10, 17);
+    matrix ac = copy_matrix(a), bc = copy_matrix(b);
+    matrix gt = naive_mult(ac, bc);
+    matrix p = matrix_mult_matrix(a, b);
+    TEST(same_matrix(gt, p));
+    free_matrix(m); free_matrix(a); free_matrix(b); free_matrix(ac); free_matrix(bc);
+    free_matrix(gt); free_matrix(p);
+}
+void test_float_gemm()
+{
+    matrix a = random_matrix(128, 785, 1);
+    matrix b = random_matrix(785, 32, 1);
+    matrix p = matrix_mult_matrix(a, b);
+    matrix pf = matrix_product(a, 0, b, 0, PRECISION_FLOAT);
+    matrix tp = matrix_product(b, 1, b, 0, PRECISION_FLOAT);
+    matrix pt = matrix_product(b, 0, b, 1, PRECISION_FLOAT);
+    matrix tpd = transpose_mult_matrix(b, b);
+    matrix ptd = matrix_mult_transpose(b, b);
+    TEST(same_matrix(p, pf));
+    TEST(same_matrix(tp, tpd));
+    TEST(same_matrix(pt, ptd));
+    int i, exact = 1;
+    for(i = 0; i < p.rows*p.cols; ++i) exact &= p.vals[i] == pf.vals[i];
+    TEST(!exact);
+    free_matrix(a); free_matrix(b); free_matrix(p); free_matrix(pf);
+    free_matrix(tp); free_matrix(pt); free_matrix(tpd); free_matrix(ptd);
+}
+void test_layer_precision()
+{
+    // forward_layer, backward_layer and update_layer are left to students,
+    // so parity is checked on the products they make through layer_product:
+    // x*w, xt*delta, delta*wt, and a weight step taken with the float dw.
+    matrix a = load_matrix("data/test/a.matrix");
+    matrix w = load_matrix("data/test/w.matrix");
+    matrix delta = load_matrix("data/test/delta.matrix");
+    matrix xw[2], dw[2], dx[2], nw[2];
+    int p;
+    for(p = 0; p < 2; ++p){
+        layer l;
+        l.precision = p ? PRECISION_FLOAT : PRECISION_DOUBLE;
+        xw[p] = layer_product(&l, a, 0, w, 0);
+        dw[p] = layer_product(&l, a, 1, delta, 0);
+        dx[p] = layer_product(&l, delta, 0, w, 1);
+        nw[p] = axpy_matrix(.01, dw[p], w);
+    }
+    TEST(same_matrix(xw[0], xw[1]));
+    TEST(same_matrix(dw[0], dw[1]));
+    TEST(same_matrix(dx[0], dx[1]));
+    TEST(same_matrix(nw[0], nw[1]));
+
+    // The float products really are done in float.
+    int i, exact = 1;
+    for(i = 0; i < xw[0].rows*xw[0].cols; ++i) exact &= xw[0].vals[i] == xw[1].vals[i];
+    TEST(!exact);
+
+    for(p = 0; p < 2; ++p){
+        free_matrix(xw[p]);
+        free_matrix(dw[p]);
+        free_matrix(dx[p]);
+        free_matrix(nw[p]);
+    }
+    free_matrix(a);
+    free_matrix(w);
+    free_matrix(delta);
+}
+void test_load_batch()
+{
+    char *paths[] = {"data/dogsmall.jpg", "data/missing.jpg", "data/dog.jpg", "data/dogsmall.jpg"};
+    image im = load_image("data/dogsmall.jpg");
+    int cols = im.w*im.h*im.c;
+    TEST(image_file_size("data/dogsmall.jpg") == cols);
+    float_matrix X = make_float_matrix(4, cols);
+    int ok[4];
+    int fails = load_image_batch(paths, 4, X, cols, ok, 3);
+    TEST(fails == 2 && ok[0] && !ok[1] && !ok[2] && ok[3]);
+    TEST(0 == memcmp(X.vals, im.data, cols*sizeof(float)));
+    TEST(0 == memcmp(X.vals + 3*cols, im.data, cols*sizeof(float)));
+    free_float_matrix(X);
+    free_image(im);
+}
+void test_data_cache()
+{
+    FILE *fp = fopen("data/test_list.txt", "w");
+    fprintf(fp, "data/dog_a_small.jpg\ndata/dog_b_small.jpg\ndata/dog_a_small.jpg\n");
+    fclose(fp);
+    fp = fopen("data/test_labels.txt", "w");
+    fprintf(fp, "_a\n_b\nsmall\n");
+    fclose(fp);
+    remove("data/test_list.txt.cache");
+
+    set_data_cache(0);
+    data plain = load_classification_data("data/test_list.txt", "data/test_labels.txt", 1);
+    set_data_cache(1);
+    data first = load_classification_data("data/test_list.txt", "data/test_labels.txt", 1);
+    FILE *cache = fopen("data/test_list.txt.cache", "rb");
+    TEST(cache != 0);
+    if(cache) fclose(cache);
+    data cached = load_classification_data("data/test_list.txt", "data/test_labels.txt", 1);
+    size_t xsize = (size_t)plain.X.rows*plain.X.cols*sizeof(float);
+    TEST(first.X.rows == plain.X.rows && first.X.cols == plain.X.cols);
+    TEST(0 == memcmp(plain.X.vals, first.X.vals, xsize) && same_matrix(plain.y, first.y));
+    TEST(0 == memcmp(plain.X.vals, cached.X.vals, xsize) && same_matrix(plain.y, cached.y));
+    TEST(cached.y.data[1][1] == 1 && cached.y.data[1][2] == 1 && cached.y.data[1][0] == 0);
+
+    // Batches are widened copies of rows of the data.
+    minibatch b = random_batch(cached, 4);
+    int i, j, found = 1;
+    for(i = 0; i < b.X.rows; ++i){
+        int match = 0;
+        for(j = 0; j < cached.X.rows; ++j){
+            matrix row = float_matrix_rows(cached.X, j, 1);
+            if(0 == memcmp(row.vals, b.X.data[i], row.cols*sizeof(double)) &&
+                    0 == memcmp(cached.y.data[j], b.y.data[i], b.y.cols*sizeof(double))) match = 1;
+            free_matrix(row);
+        }
+        found &= match;
+    }
+    TEST(found && b.X.data[0][b.X.cols-1] == 1);
+    free_matrix(b.X);
+    free_matrix(b.y);
+
+    // Changing the list invalidates the cache.
+    fp = fopen("data/test_list.txt", "w");
+    fprintf(fp, "data/dog_b_small.jpg\n");
+    fclose(fp);
+    data changed = load_classification_data("data/test_list.txt", "data/test_labels.txt", 1);
+    TEST(changed.X.rows == 1 && changed.y.data[0][1] == 1);
+
+    // With a cache directory the cache goes there instead, named after the
+    // list's path.
+    remove("data/test_list.txt.cache");
+    set_data_cache_dir("figs");
+    data moved = load_classification_data("data/test_list.txt", "data/test_labels.txt", 1);
+    cache = fopen("data/test_list.txt.cache", "rb");
+    TEST(cache == 0);
+    if(cache) fclose(cache);
+    cache = fopen("figs/data_test_list.txt.cache", "rb");
+    TEST(cache != 0);
+    if(cache) fclose(cache);
+    set_data_cache_dir(0);
+    remove("figs/data_test_list.txt.cache");
+    free_data(moved);
+
+    remove("data/test_list.txt");
+    remove("data/test_labels.txt");
+    remove("data/test_list.txt.cache");
+    free_data(plain);
+    free_data(first);
+    free_data(cached);
+    free_data(changed);
+}
 void test_hw5()
 {
     test_activate_matrix();
     test_gradient_matrix();
     test_layer();
+    test_matrix_layout();
+    test_gemm();
+    test_float_gemm();
+    test_layer_precision();
+    test_load_batch();
+    test_data_cache();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
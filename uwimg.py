@@ -20,6 +20,19 @@ class IMAGE(Structure):
     def __sub__(self, other):
         return sub_image(self, other)
 
+class PYRAMID(Structure):
+    _fields_ = [("n", c_int),
+                ("built", c_int),
+                ("levels", POINTER(IMAGE))]
+
+class FLOW_STATS(Structure):
+    _fields_ = [("frames", c_int),
+                ("capture", c_double),
+                ("wait", c_double),
+                ("prepare", c_double),
+                ("flow", c_double),
+                ("sink", c_double)]
+
 class POINT(Structure):
     _fields_ = [("x", c_float),
                 ("y", c_float)]
@@ -33,10 +46,17 @@ class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
                 ("data", POINTER(POINTER(c_double))),
-                ("shallow", c_int)]
+                ("shallow", c_int),
+                ("vals", POINTER(c_double)),
+                ("stride", c_int)]
+
+class FLOAT_MATRIX(Structure):
+    _fields_ = [("rows", c_int),
+                ("cols", c_int),
+                ("vals", POINTER(c_float))]
 
 class DATA(Structure):
-    _fields_ = [("X", MATRIX),
+    _fields_ = [("X", FLOAT_MATRIX),
                 ("y", MATRIX)]
 
 class LAYER(Structure):
@@ -45,7 +65,8 @@ class LAYER(Structure):
                 ("w", MATRIX),
                 ("v", MATRIX),
                 ("out", MATRIX),
-                ("activation", c_int)]
+                ("activation", c_int),
+                ("precision", c_int)]
 
 class MODEL(Structure):
     _fields_ = [("layers", POINTER(LAYER)),
@@ -53,7 +74,32 @@ class MODEL(Structure):
 
 
 (LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX) = range(5)
+(PRECISION_DOUBLE, PRECISION_FLOAT) = range(2)
+
+
+set_num_threads = lib.set_num_threads
+set_num_threads.argtypes = [c_int]
+set_num_threads.restype = None
+
+get_num_threads = lib.get_num_threads
+get_num_threads.argtypes = []
+get_num_threads.restype = c_int
+
+make_image_pool = lib.make_image_pool
+make_image_pool.argtypes = []
+make_image_pool.restype = c_void_p
+
+use_image_pool = lib.use_image_pool
+use_image_pool.argtypes = [c_void_p]
+use_image_pool.restype = c_void_p
+
+reset_image_pool = lib.reset_image_pool
+reset_image_pool.argtypes = [c_void_p]
+reset_image_pool.restype = None
 
+free_image_pool = lib.free_image_pool
+free_image_pool.argtypes = [c_void_p]
+free_image_pool.restype = None
 
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
@@ -102,6 +148,14 @@ hsv_to_rgb = lib.hsv_to_rgb
 hsv_to_rgb.argtypes = [IMAGE]
 hsv_to_rgb.restype = None
 
+rgb_to_hsv_fast = lib.rgb_to_hsv_fast
+rgb_to_hsv_fast.argtypes = [IMAGE]
+rgb_to_hsv_fast.restype = None
+
+hsv_to_rgb_fast = lib.hsv_to_rgb_fast
+hsv_to_rgb_fast.argtypes = [IMAGE]
+hsv_to_rgb_fast.restype = None
+
 shift_image = lib.shift_image
 shift_image.argtypes = [IMAGE, c_int, c_float]
 shift_image.restype = None
@@ -131,6 +185,27 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+save_image_binary_lib = lib.save_image_binary
+save_image_binary_lib.argtypes = [IMAGE, c_char_p]
+save_image_binary_lib.restype = None
+
+def save_image_binary(im, f):
+    return save_image_binary_lib(im, f.encode('ascii'))
+
+load_image_binary_lib = lib.load_image_binary
+load_image_binary_lib.argtypes = [c_char_p]
+load_image_binary_lib.restype = IMAGE
+
+def load_image_binary(f):
+    return load_image_binary_lib(f.encode('ascii'))
+
+map_image_binary_lib = lib.map_image_binary
+map_image_binary_lib.argtypes = [c_char_p]
+map_image_binary_lib.restype = IMAGE
+
+def map_image_binary(f):
+    return map_image_binary_lib(f.encode('ascii'))
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE, c_float]
 same_image.restype = c_int
@@ -143,6 +218,16 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+area_resize = lib.area_resize
+area_resize.argtypes = [IMAGE, c_int, c_int]
+area_resize.restype = IMAGE
+
+RESAMPLE_AREA, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS3 = 0, 1, 2
+
+resample_image = lib.resample_image
+resample_image.argtypes = [IMAGE, c_int, c_int, c_int]
+resample_image.restype = IMAGE
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -171,6 +256,10 @@ sobel_image = lib.sobel_image
 sobel_image.argtypes = [IMAGE]
 sobel_image.restype = POINTER(IMAGE)
 
+sobel_image_fast = lib.sobel_image_fast
+sobel_image_fast.argtypes = [IMAGE]
+sobel_image_fast.restype = POINTER(IMAGE)
+
 colorize_sobel = lib.colorize_sobel
 colorize_sobel.argtypes = [IMAGE]
 colorize_sobel.restype = IMAGE
@@ -219,14 +308,64 @@ box_filter_image = lib.box_filter_image
 box_filter_image.argtypes = [IMAGE, c_int]
 box_filter_image.restype = IMAGE
 
+pyr_down = lib.pyr_down
+pyr_down.argtypes = [IMAGE]
+pyr_down.restype = IMAGE
+
+pyr_up = lib.pyr_up
+pyr_up.argtypes = [IMAGE, c_int, c_int]
+pyr_up.restype = IMAGE
+
+make_pyramid = lib.make_pyramid
+make_pyramid.argtypes = [IMAGE, c_int]
+make_pyramid.restype = PYRAMID
+
+get_pyramid_level = lib.get_pyramid_level
+get_pyramid_level.argtypes = [POINTER(PYRAMID), c_int]
+get_pyramid_level.restype = IMAGE
+
+free_pyramid = lib.free_pyramid
+free_pyramid.argtypes = [PYRAMID]
+free_pyramid.restype = None
+
+make_laplacian_pyramid = lib.make_laplacian_pyramid
+make_laplacian_pyramid.argtypes = [IMAGE, c_int]
+make_laplacian_pyramid.restype = PYRAMID
+
+collapse_laplacian_pyramid = lib.collapse_laplacian_pyramid
+collapse_laplacian_pyramid.argtypes = [PYRAMID]
+collapse_laplacian_pyramid.restype = IMAGE
+
+SMOOTH_CONVOLVE, SMOOTH_RECURSIVE = 0, 1
+
+set_smooth_mode = lib.set_smooth_mode
+set_smooth_mode.argtypes = [c_int]
+set_smooth_mode.restype = None
+
 optical_flow_images = lib.optical_flow_images
 optical_flow_images.argtypes = [IMAGE, IMAGE, c_int, c_int]
 optical_flow_images.restype = IMAGE
 
+optical_flow_pyramid = lib.optical_flow_pyramid
+optical_flow_pyramid.argtypes = [IMAGE, IMAGE, c_int, c_int, c_int]
+optical_flow_pyramid.restype = IMAGE
+
+set_flow_min_eigenvalue = lib.set_flow_min_eigenvalue
+set_flow_min_eigenvalue.argtypes = [c_float]
+set_flow_min_eigenvalue.restype = None
+
+set_flow_pyramid = lib.set_flow_pyramid
+set_flow_pyramid.argtypes = [c_int, c_int]
+set_flow_pyramid.restype = None
+
 optical_flow_webcam = lib.optical_flow_webcam
 optical_flow_webcam.argtypes = [c_int, c_int, c_int]
 optical_flow_webcam.restype = None
 
+optical_flow_files = lib.optical_flow_files
+optical_flow_files.argtypes = [c_char_p, c_char_p, c_int, c_int, c_int]
+optical_flow_files.restype = FLOW_STATS
+
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 
@@ -247,6 +386,14 @@ load_classification_data = lib.load_classification_data
 load_classification_data.argtypes = [c_char_p, c_char_p, c_int]
 load_classification_data.restype = DATA
 
+set_data_cache = lib.set_data_cache
+set_data_cache.argtypes = [c_int]
+set_data_cache.restype = None
+
+set_data_cache_dir = lib.set_data_cache_dir
+set_data_cache_dir.argtypes = [c_char_p]
+set_data_cache_dir.restype = None
+
 make_layer = lib.make_layer
 make_layer.argtypes = [c_int, c_int, c_int]
 make_layer.restype = LAYER
@@ -257,6 +404,10 @@ def make_model(layers):
     m.layers = (LAYER*m.n) (*layers)
     return m
 
+set_model_precision = lib.set_model_precision
+set_model_precision.argtypes = [MODEL, c_int]
+set_model_precision.restype = None
+
 if __name__ == "__main__":
     im = load_image("data/dog.jpg")
     save_image(im, "hey")